@@ -0,0 +1,241 @@
+#!/usr/bin/python3
+
+# Pick the fastest backend, number of threads and thread placement for the
+# resolution of an input on this host, by timing the first frames of the
+# input with every candidate. The winner is cached in a profile file, one line
+# per host, resolution and backend options, and reused by later runs.
+#
+#   ./autotune.py tune <IN.mpg> [-- OPTIONS]    time the candidates, save the best
+#   ./autotune.py run <IN.mpg> [OUT.mpg] [-- OPTIONS]
+#                                               run the best configuration,
+#                                               tuning first if there is none
+#   ./autotune.py show                          print the profile
+
+import argparse
+import multiprocessing
+import os
+import shlex
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+PROFILE = os.path.join(ROOT, 'autotune.profile')
+
+BACKENDS = ['serial', 'omp', 'pthreads', 'mpi', 'mpi-omp']
+PLACEMENTS = ['', 'compact', 'scatter']
+
+# MPI needs the master and at least two workers.
+MIN_TASKS = {'mpi': 3, 'mpi-omp': 3}
+
+WARMUP_FRAMES = 1
+
+
+def host():
+    return socket.gethostname()
+
+
+def resolution(file_in):
+    """WIDTHxHEIGHT of the first video stream, as ffprobe reports it."""
+    if shutil.which('ffprobe') is None:
+        sys.exit('ffprobe not found, pass the resolution with --size')
+
+    out = subprocess.check_output(['ffprobe', '-v', 'error', '-select_streams', 'v:0',
+                                   '-show_entries', 'stream=width,height',
+                                   '-of', 'csv=s=x:p=0', file_in])
+    return out.decode().strip()
+
+
+def options(extra):
+    """The backend options as they are keyed in the profile."""
+    return ' '.join(shlex.quote(arg) for arg in extra)
+
+
+def binary(backend):
+    return os.path.join(ROOT, backend, backend)
+
+
+def command(backend, threads, placement, file_in, file_out, extra=[]):
+    if backend == 'serial':
+        return [binary(backend)] + extra + [file_in, file_out]
+
+    if backend in ('mpi', 'mpi-omp'):
+        return ['mpirun', '-np', str(threads), binary(backend)] + extra + [file_in, file_out]
+
+    if placement:
+        extra = ['-b', placement] + extra
+
+    return [binary(backend)] + extra + [file_in, str(threads), file_out]
+
+
+def candidates(thread_counts):
+    for backend in BACKENDS:
+        if not os.access(binary(backend), os.X_OK):
+            continue
+
+        if backend == 'serial':
+            yield backend, 1, ''
+            continue
+
+        if backend in MIN_TASKS and shutil.which('mpirun') is None:
+            continue
+
+        for threads in thread_counts:
+            if threads < MIN_TASKS.get(backend, 1):
+                continue
+
+            placements = PLACEMENTS if backend in ('omp', 'pthreads') else ['']
+            for placement in placements:
+                yield backend, threads, placement
+
+
+def trial(cmd, frames):
+    """Median time per frame over the first frames, after a warmup."""
+    times = []
+
+    # Line buffered, so that the trial can stop as soon as it has its frames.
+    if shutil.which('stdbuf'):
+        cmd = ['stdbuf', '-oL'] + cmd
+
+    workdir = tempfile.mkdtemp(prefix='autotune')
+    proc = subprocess.Popen(cmd, cwd=workdir, stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL)
+
+    for line in proc.stdout:
+        line = line.decode(errors='replace')
+        if 'Time per frame:' not in line:
+            continue
+
+        times.append(float(line.rsplit(':', 1)[1]))
+        if len(times) == WARMUP_FRAMES + frames:
+            break
+
+    proc.terminate()
+    proc.wait()
+    shutil.rmtree(workdir, ignore_errors=True)
+
+    times = sorted(times[WARMUP_FRAMES:])
+    if not times:
+        return None
+
+    return times[len(times) // 2]
+
+
+def load():
+    profile = {}
+
+    if not os.path.exists(PROFILE):
+        return profile
+
+    with open(PROFILE) as f:
+        for line in f:
+            if line.startswith('#') or not line.strip():
+                continue
+
+            fields = line.rstrip('\n').split('\t')
+
+            # Profiles from before the options were keyed hold tunings without any.
+            if len(fields) == 6:
+                fields.insert(2, '')
+
+            profile[tuple(fields[:3])] = (fields[3], int(fields[4]), fields[5], float(fields[6]))
+
+    return profile
+
+
+def save(profile):
+    with open(PROFILE, 'w') as f:
+        f.write('# host\tresolution\toptions\tbackend\tthreads\tplacement\ttime per frame\n')
+        for key in sorted(profile):
+            backend, threads, placement, time = profile[key]
+            f.write('%s\t%s\t%s\t%s\t%d\t%s\t%f\n' % (key[0], key[1], key[2], backend, threads,
+                                                     placement, time))
+
+
+def tune(args):
+    size = args.size or resolution(args.input)
+    file_in = os.path.abspath(args.input)
+    best = None
+
+    for backend, threads, placement in candidates(args.threads):
+        cmd = command(backend, threads, placement, file_in, 'out.mpg', args.extra)
+        time = trial(cmd, args.frames)
+
+        print('%-8s %3d threads %-8s %s' % (backend, threads, placement or '-',
+                                            'failed' if time is None else '%f' % time))
+
+        if time is not None and (best is None or time < best[3]):
+            best = (backend, threads, placement, time)
+
+    if best is None:
+        sys.exit('no backend could be timed, build them first')
+
+    profile = load()
+    profile[(host(), size, options(args.extra))] = best
+    save(profile)
+
+    print('Best for %s%s on %s: %s, %d threads%s' % (size, ' with ' + options(args.extra) if args.extra else '',
+                                                     host(), best[0], best[1],
+                                                     ', ' + best[2] if best[2] else ''))
+    return best
+
+
+def run(args):
+    size = args.size or resolution(args.input)
+    config = load().get((host(), size, options(args.extra)))
+
+    if config is None:
+        config = tune(args)
+
+    backend, threads, placement, _ = config
+    cmd = command(backend, threads, placement, args.input, args.output, args.extra)
+    os.execvp(cmd[0], cmd)
+
+
+def show(args):
+    for (h, size, opts), (backend, threads, placement, time) in sorted(load().items()):
+        print('%s %s%s: %s, %d threads%s (%f s per frame)' % (h, size, ' ' + opts if opts else '',
+                                                              backend, threads,
+                                                              ', ' + placement if placement else '',
+                                                              time))
+
+
+def main():
+    ncpus = multiprocessing.cpu_count()
+    default_threads = sorted(set([1, 2, 4] + list(range(6, ncpus + 1, 2)) + [ncpus]))
+
+    parser = argparse.ArgumentParser(description='Per host and resolution backend autotuner.')
+    sub = parser.add_subparsers(dest='mode')
+    sub.required = True
+
+    for name in ('tune', 'run'):
+        p = sub.add_parser(name)
+        p.add_argument('input')
+        if name == 'run':
+            p.add_argument('output', nargs='?', default='out.mpg')
+        p.add_argument('--frames', type=int, default=5,
+                       help='frames timed per trial, after a warmup frame (default: 5)')
+        p.add_argument('--threads', type=lambda s: [int(t) for t in s.split(',')],
+                       default=default_threads,
+                       help='comma-separated thread counts to try (default: up to the CPUs)')
+        p.add_argument('--size', help='WIDTHxHEIGHT of the input, instead of asking ffprobe')
+
+    sub.add_parser('show')
+
+    # Anything after -- is passed on to the backend.
+    argv = sys.argv[1:]
+    extra = []
+    if '--' in argv:
+        extra = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+
+    args = parser.parse_args(argv)
+    args.extra = extra
+
+    {'tune': tune, 'run': run, 'show': show}[args.mode](args)
+
+
+if __name__ == '__main__':
+    main()
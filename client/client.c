@@ -0,0 +1,114 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define STATUS "Job status: "
+
+/*
+ * Client of the OpenMP backend's daemon mode (omp -D SOCKET NUM).
+ *
+ * Sends one job, the same options and files as a plain omp run minus the
+ * number of threads, and prints what the job prints. Relative paths are
+ * resolved by the daemon in the client's working directory. The exit status
+ * is the job's.
+ */
+
+static void
+print_usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s <SOCKET> [OPTIONS] <IN.mpg> [OUT.mpg]\n", argv0);
+  fprintf(stderr, "Required arguments:\n"
+                  "  <SOCKET>\tthe socket the daemon listens on\n"
+                  "  <IN.mpg>\tthe input video file\n"
+                  "Optional arguments:\n"
+                  "  [OPTIONS]\tany option of omp but -b, -H, -D and -B\n"
+                  "  [OUT.mpg]\tthe output video file\n");
+}
+
+static void
+write_all(const int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    DIE(n < 0, "write");
+    buf += n;
+    len -= n;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  char cwd[PATH_MAX];
+  char *reply = NULL, *last;
+  size_t len = 0, size = 0;
+  ssize_t n;
+  int fd, i;
+
+  if (argc < 3) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  DIE(strlen(argv[1]) >= sizeof(addr.sun_path), "socket path too long");
+  strcpy(addr.sun_path, argv[1]);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  DIE(fd < 0, "socket");
+  DIE(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0, "connect");
+
+  /* The working directory, the arguments, then an empty string. */
+  DIE(getcwd(cwd, sizeof(cwd)) == NULL, "getcwd");
+  write_all(fd, cwd, strlen(cwd) + 1);
+
+  for (i = 2; i < argc; i++)
+    write_all(fd, argv[i], strlen(argv[i]) + 1);
+  write_all(fd, "", 1);
+
+  /* Read the whole reply, to take the status line off its end. */
+  while (1) {
+    if (len == size) {
+      size = size ? 2 * size : 4096;
+      reply = realloc(reply, size + 1);
+      DIE(reply == NULL, "realloc");
+    }
+
+    n = read(fd, reply + len, size - len);
+    DIE(n < 0, "read");
+    if (n == 0)
+      break;
+    len += n;
+  }
+
+  close(fd);
+
+  if (reply == NULL) {
+    fprintf(stderr, "No reply from the daemon\n");
+    exit(1);
+  }
+  reply[len] = '\0';
+
+  last = strstr(reply, STATUS);
+  while (last && strstr(last + 1, STATUS))
+    last = strstr(last + 1, STATUS);
+
+  if (last == NULL) {
+    fputs(reply, stdout);
+    fprintf(stderr, "The daemon did not finish the job\n");
+    exit(1);
+  }
+
+  fwrite(reply, 1, last - reply, stdout);
+  i = atoi(last + strlen(STATUS));
+  free(reply);
+
+  return i;
+}
@@ -0,0 +1,524 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hysteresis.h"
+#include "kernels.h"
+#include "utils.h"
+
+#define MAX_BRIGHTNESS 255
+#define CANNY_LOWER 45
+#define CANNY_UPPER 50
+#define CANNY_SIGMA 1.0
+
+/* Default memory budget for the tile and band buffers, in MiB. */
+#define BUDGET 64
+
+/* Pixels of the output file until hysteresis resolves them. */
+#define WEAK 1
+#define STRONG MAX_BRIGHTNESS
+
+/* Use short int instead unsigned char so that we can store negative values. */
+typedef short int pixel_t;
+
+/*
+ * Out-of-core Canny edge detection on a single huge grayscale image.
+ *
+ * Both the input and the output files are memory-mapped, so the page cache
+ * rather than the heap holds the image, and the process only allocates the
+ * buffers of one tile and one band of rows, sized from the memory budget.
+ *
+ * The first pass goes over the image in square tiles. Every tile is blurred,
+ * differentiated and thinned together with a halo wide enough for the blur,
+ * Sobel and non-maximum suppression, reading the luma straight from the
+ * mapping, and each of its pixels is written to the output as 0, WEAK or
+ * STRONG.
+ *
+ * Hysteresis then runs over bands of full rows: every band is loaded into
+ * the bit planes of hysteresis.h with one row of context above and below,
+ * grown until it stops changing and written back. Sweeping the bands down
+ * and up until a whole round changes nothing gives exactly the edges that a
+ * single frame-wide hysteresis would, however often an edge crosses from a
+ * band to another. A last sequential pass clears the weak pixels left over.
+ *
+ * Every stage does the same arithmetic as the video backends, taking the
+ * pixels the blur does not reach as 0, so a frame gives the same edges here
+ * and there.
+ */
+
+typedef struct {
+  size_t width;
+  size_t height;
+  uint8_t *data;
+  void *map;
+  size_t size;
+} image_t;
+
+/*
+ * Parse the header of a binary PGM (P5) with a maxval of at most 255.
+ * Returns the offset of the pixels, or 0 if the header is malformed.
+ */
+static size_t
+pgm_parse_header(const uint8_t *p, const size_t size, size_t *width, size_t *height)
+{
+  unsigned long long values[3];
+  size_t i = 2;
+  int k;
+
+  if (size < 2 || p[0] != 'P' || p[1] != '5')
+    return 0;
+
+  for (k = 0; k < 3; k++) {
+    /* Whitespace and comments. */
+    while (i < size && (p[i] == ' ' || p[i] == '\t' || p[i] == '\r' || p[i] == '\n' || p[i] == '#')) {
+      if (p[i] == '#')
+        while (i < size && p[i] != '\n')
+          i++;
+      else
+        i++;
+    }
+
+    if (i == size || p[i] < '0' || p[i] > '9')
+      return 0;
+
+    values[k] = 0;
+    while (i < size && p[i] >= '0' && p[i] <= '9')
+      values[k] = values[k] * 10 + p[i++] - '0';
+  }
+
+  /* A single whitespace character ends the header. */
+  if (i == size || values[2] == 0 || values[2] > MAX_BRIGHTNESS)
+    return 0;
+
+  *width = values[0];
+  *height = values[1];
+
+  return i + 1;
+}
+
+/*
+ * Map path, a PGM file, or raw luma of width x height if width is not 0.
+ */
+static image_t
+image_map(const char *path, const size_t width, const size_t height)
+{
+  image_t image;
+  struct stat st;
+  size_t offset = 0;
+
+  int fd = open(path, O_RDONLY);
+  DIE(fd < 0, "open");
+
+  DIE(fstat(fd, &st) < 0, "fstat");
+  DIE(st.st_size == 0, "empty input");
+
+  image.size = st.st_size;
+  image.map = mmap(NULL, image.size, PROT_READ, MAP_SHARED, fd, 0);
+  DIE(image.map == MAP_FAILED, "mmap");
+  DIE(close(fd) < 0, "close");
+
+  if (width) {
+    image.width = width;
+    image.height = height;
+  } else {
+    offset = pgm_parse_header(image.map, image.size, &image.width, &image.height);
+    DIE(offset == 0, "not a binary PGM");
+  }
+
+  /* The unrolled taps index rows with int. */
+  DIE(image.width < 3 || image.height < 3 || image.width > INT_MAX / 8 ||
+      offset + image.width * image.height > image.size, "bad image size");
+
+  image.data = (uint8_t *) image.map + offset;
+
+  return image;
+}
+
+/*
+ * Create path as a width x height PGM full of zeros and map it.
+ */
+static image_t
+image_create(const char *path, const size_t width, const size_t height)
+{
+  image_t image;
+  char header[64];
+  const int len = snprintf(header, sizeof(header), "P5\n%zu %zu\n%d\n", width, height, MAX_BRIGHTNESS);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  DIE(fd < 0, "open");
+
+  DIE(write(fd, header, len) != len, "write");
+
+  image.width = width;
+  image.height = height;
+  image.size = len + width * height;
+  DIE(ftruncate(fd, image.size) < 0, "ftruncate");
+
+  image.map = mmap(NULL, image.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  DIE(image.map == MAP_FAILED, "mmap");
+  DIE(close(fd) < 0, "close");
+
+  image.data = (uint8_t *) image.map + len;
+
+  return image;
+}
+
+static void
+image_unmap(image_t *image, const bool sync)
+{
+  if (sync)
+    DIE(msync(image->map, image->size, MS_SYNC) < 0, "msync");
+
+  DIE(munmap(image->map, image->size) < 0, "munmap");
+}
+
+typedef struct {
+  int kn;
+  float kernel[];
+} gaussian_t;
+
+/*
+ * Same kernel as gaussian_filter() in the video backends.
+ */
+static gaussian_t *
+gaussian_create(const float sigma)
+{
+  const int n = 2 * (int) (2 * sigma) + 3;
+  const float mean = (float) floor(n / 2.0);
+  size_t c = 0;
+  int i, j;
+
+  gaussian_t *g = malloc(sizeof(gaussian_t) + n * n * sizeof(float));
+  DIE(g == NULL, "malloc");
+
+  g->kn = n;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++)
+      g->kernel[c++] = exp(-0.5 * (pow((i - mean) / sigma, 2.0) + pow((j - mean) / sigma, 2.0))) / (2 * M_PI * sigma * sigma);
+  }
+
+  return g;
+}
+
+/* Buffers of one tile of at most side x side pixels plus the halo. */
+typedef struct {
+  int side;
+  pixel_t *blur;
+  pixel_t *after_Gx;
+  pixel_t *after_Gy;
+  pixel_t *G;
+} tile_t;
+
+static tile_t
+tile_create(const int side)
+{
+  const size_t size = (size_t) (side + 4) * (side + 4);
+  tile_t t;
+
+  t.side = side;
+
+  t.blur = malloc(size * sizeof(pixel_t));
+  DIE(t.blur == NULL, "malloc");
+
+  t.after_Gx = malloc(size * sizeof(pixel_t));
+  DIE(t.after_Gx == NULL, "malloc");
+
+  t.after_Gy = malloc(size * sizeof(pixel_t));
+  DIE(t.after_Gy == NULL, "malloc");
+
+  t.G = malloc(size * sizeof(pixel_t));
+  DIE(t.G == NULL, "malloc");
+
+  return t;
+}
+
+static void
+tile_free(tile_t *t)
+{
+  free(t->blur);
+  free(t->after_Gx);
+  free(t->after_Gy);
+  free(t->G);
+}
+
+/*
+ * Classify the pixels of [x0, x1) x [y0, y1) into out. The blur covers the
+ * tile and 2 pixels around it (1 for Sobel, 1 for non-maximum suppression),
+ * reading the luma from the image with the kernel's own halo.
+ *
+ * Note: T1 and T2 are lower and upper thresholds.
+ */
+static void
+tile_canny(tile_t           *t,
+           const image_t    *in,
+           image_t          *out,
+           const gaussian_t *g,
+           const size_t      x0,
+           const size_t      y0,
+           const size_t      x1,
+           const size_t      y1,
+           const int         t1,
+           const int         t2)
+{
+  static const float Gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+  static const float Gy[] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+  const size_t W = in->width;
+  const size_t H = in->height;
+  const size_t seed_limit = (W - 2) * (H - 2);
+  const size_t khalf = g->kn / 2;
+
+  /* The tile buffers start 2 pixels up and left of the tile, clipped. */
+  const size_t bx0 = x0 >= 2 ? x0 - 2 : 0;
+  const size_t by0 = y0 >= 2 ? y0 - 2 : 0;
+  const size_t bx1 = x1 + 2 <= W ? x1 + 2 : W;
+  const size_t by1 = y1 + 2 <= H ? y1 + 2 : H;
+  const int nx = bx1 - bx0;
+  const int ny = by1 - by0;
+
+  /* The part of them where the blur kernel fits in the image. */
+  const size_t fx0 = bx0 > khalf ? bx0 : khalf;
+  const size_t fy0 = by0 > khalf ? by0 : khalf;
+  const size_t fx1 = bx1 < W - khalf ? bx1 : W - khalf;
+  const size_t fy1 = by1 < H - khalf ? by1 : H - khalf;
+  size_t X, Y;
+  int m, n;
+
+  /* Blur, 0 where the kernel does not fit in the image. */
+  memset(t->blur, 0, (size_t) nx * ny * sizeof(pixel_t));
+
+  if (fx0 < fx1 && fy0 < fy1)
+    kernel_convolve_u8(g->kn)(in->data + fy0 * W + fx0, W,
+                              t->blur + (fy0 - by0) * nx + fx0 - bx0, nx, g->kernel, g->kn,
+                              fx1 - fx0, fy1 - fy0, true);
+
+  /* Sobel and gradient magnitude, 0 on the image border. */
+  for (n = 0; n < ny; n++) {
+    Y = by0 + n;
+
+    for (m = 0; m < nx; m++) {
+      const int c = n * nx + m;
+      X = bx0 + m;
+
+      if (X == 0 || X == W - 1 || Y == 0 || Y == H - 1 ||
+          m == 0 || m == nx - 1 || n == 0 || n == ny - 1) {
+        t->after_Gx[c] = t->after_Gy[c] = t->G[c] = 0;
+        continue;
+      }
+
+      t->after_Gx[c] = (pixel_t) kernel_taps_3(t->blur + c, nx, Gx);
+      t->after_Gy[c] = (pixel_t) kernel_taps_3(t->blur + c, nx, Gy);
+      t->G[c] = (pixel_t) hypot(t->after_Gx[c], t->after_Gy[c]);
+    }
+  }
+
+  /* Non-maximum suppression of the tile itself. */
+  for (Y = y0; Y < y1; Y++) {
+    n = Y - by0;
+
+    for (X = x0; X < x1; X++) {
+      const pixel_t *G = t->G;
+      const int c = n * nx + X - bx0;
+      const int nn = c - nx;
+      const int ss = c + nx;
+      const int ww = c + 1;
+      const int ee = c - 1;
+      const int nw = nn + 1;
+      const int ne = nn - 1;
+      const int sw = ss + 1;
+      const int se = ss - 1;
+      pixel_t nms = 0;
+
+      if (G[c] >= t1) {
+        const float dir = (float) (fmod(atan2(t->after_Gy[c], t->after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
+
+        if (((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
+            ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
+            ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
+            ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]))   // 135 deg
+          nms = G[c];
+      }
+
+      /* Like the video backends, edges only start up to seed_limit. */
+      if (nms >= t2 && Y * W + X <= seed_limit)
+        out->data[Y * W + X] = STRONG;
+      else if (nms >= t1)
+        out->data[Y * W + X] = WEAK;
+    }
+  }
+}
+
+/*
+ * Grow the edges of image rows [y0, y0 + rows) in place, with the rows right
+ * above and below as context. Returns true if any pixel changed.
+ */
+static bool
+band_hysteresis(hysteresis_t *hy, image_t *out, const size_t y0, const int rows)
+{
+  const size_t W = out->width;
+  bool changed = false;
+  int y;
+
+  hysteresis_clear(hy);
+
+  for (y = 0; y < rows + 2; y++)
+    hysteresis_load_row(hy, y, out->data + (y0 - 1 + y) * W);
+
+  hysteresis_run(hy);
+
+  for (y = 1; y <= rows; y++)
+    changed |= hysteresis_store_row(hy, y, out->data + (y0 - 1 + y) * W);
+
+  return changed;
+}
+
+/*
+ * Number of rows in band b, the last band being shorter.
+ */
+static int
+band_rows(const image_t *image, const size_t b, const int band)
+{
+  const size_t y0 = 1 + b * band;
+
+  return y0 + band < image->height - 1 ? band : (int) (image->height - 1 - y0);
+}
+
+static void
+print_usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-b BUDGET] [-s SIGMA] [-w WIDTH -h HEIGHT] <IN.pgm> <OUT.pgm>\n", argv0);
+  fprintf(stderr, "Required arguments:\n"
+                  "  <IN.pgm>\tthe input image, a binary PGM, or raw luma with -w and -h\n"
+                  "  <OUT.pgm>\tthe output edge map\n"
+                  "Optional arguments:\n"
+                  "  -b BUDGET\tmemory for the tile and band buffers, in MiB (default: 64)\n"
+                  "  -s SIGMA\tGaussian blur sigma, at least 0.5 (default: 1.0)\n"
+                  "  -w WIDTH\twidth of a raw input\n"
+                  "  -h HEIGHT\theight of a raw input\n");
+}
+
+int main(int argc, char **argv)
+{
+  size_t budget = (size_t) BUDGET << 20;
+  size_t width = 0, height = 0;
+  float sigma = CANNY_SIGMA;
+  size_t x0, y0, b, p;
+  int side, band, rounds = 0;
+  bool changed;
+  int opt;
+
+  struct timespec start, middle, end;
+
+  while ((opt = getopt(argc, argv, "b:s:w:h:")) != -1) {
+    switch (opt) {
+    case 'b':
+      budget = (size_t) atol(optarg) << 20;
+      break;
+    case 's':
+      sigma = atof(optarg);
+      if (sigma < 0.5) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'w':
+      width = atol(optarg);
+      break;
+    case 'h':
+      height = atol(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (argc - optind != 2 || (width == 0) != (height == 0)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  image_t in = image_map(argv[optind], width, height);
+  image_t out = image_create(argv[optind + 1], in.width, in.height);
+  gaussian_t *g = gaussian_create(sigma);
+
+  DIE((size_t) g->kn >= in.width || (size_t) g->kn >= in.height, "image smaller than the Gaussian kernel");
+
+  /* 4 pixel_t per tile pixel, and 2 bits per pixel of a band. */
+  side = (int) sqrt(budget / (4 * sizeof(pixel_t))) - 4;
+  band = budget / ((in.width + 63) / 64 * 2 * sizeof(uint64_t)) - 2;
+  DIE(side < 16 || band < 1, "memory budget too small");
+
+  if (band > (int) in.height - 2)
+    band = in.height - 2;
+
+  tile_t tile = tile_create(side);
+
+  DIE(madvise(in.map, in.size, MADV_SEQUENTIAL) < 0, "madvise");
+
+  DIE(clock_gettime(CLOCK_MONOTONIC, &start) == -1, "clock_gettime");
+
+  /* Classify the interior, tile by tile. The border stays 0. */
+  for (y0 = 1; y0 < in.height - 1; y0 += side) {
+    const size_t y1 = y0 + side < in.height - 1 ? y0 + side : in.height - 1;
+
+    for (x0 = 1; x0 < in.width - 1; x0 += side) {
+      const size_t x1 = x0 + side < in.width - 1 ? x0 + side : in.width - 1;
+
+      tile_canny(&tile, &in, &out, g, x0, y0, x1, y1, CANNY_LOWER, CANNY_UPPER);
+    }
+  }
+
+  tile_free(&tile);
+
+  DIE(clock_gettime(CLOCK_MONOTONIC, &middle) == -1, "clock_gettime");
+
+  /* Sweep the bands of interior rows down and up until the edges stop growing. */
+  hysteresis_t *hy = hysteresis_create(in.width, band + 2);
+  const size_t nbands = (in.height - 2 + band - 1) / band;
+
+  do {
+    changed = false;
+
+    for (b = 0; b < nbands; b++)
+      changed |= band_hysteresis(hy, &out, 1 + b * band, band_rows(&in, b, band));
+
+    for (b = nbands; b-- > 0; )
+      changed |= band_hysteresis(hy, &out, 1 + b * band, band_rows(&in, b, band));
+
+    rounds++;
+  } while (changed);
+
+  hysteresis_free(hy);
+
+  /* Weak pixels that no edge reached. */
+  for (p = 0; p < in.width * in.height; p++) {
+    if (out.data[p] == WEAK)
+      out.data[p] = 0;
+  }
+
+  DIE(clock_gettime(CLOCK_MONOTONIC, &end) == -1, "clock_gettime");
+
+  printf("Tile size: %d, band height: %d\n", side, band);
+  printf("Classification time: %lf\n",
+         middle.tv_sec - start.tv_sec + (middle.tv_nsec - start.tv_nsec) / 1000000000.0);
+  printf("Hysteresis time: %lf (%d rounds)\n",
+         end.tv_sec - middle.tv_sec + (end.tv_nsec - middle.tv_nsec) / 1000000000.0, rounds);
+  printf("Computational time: %lf\n",
+         end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1000000000.0);
+
+  free(g);
+  image_unmap(&out, true);
+  image_unmap(&in, false);
+
+  return 0;
+}
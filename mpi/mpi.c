@@ -3,9 +3,17 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "../libde/de.h"
+#include "codec.h"
+#include "edgemap.h"
+#include "frames.h"
+#include "hysteresis.h"
+#include "iir.h"
+#include "kernels.h"
 #include "mpi.h"
+#include "pull.h"
 #include "utils.h"
 
 #define MAX_BRIGHTNESS 255
@@ -13,10 +21,7 @@
 #define CANNY_UPPER 50
 #define CANNY_SIGMA 1.0
 
-#define TAG_WORK       42
-#define TAG_SIZE       43
 #define BUFFSIZE       16777216 // 16 MiB
-#define CORRECTION     20
 
 /* Use short int instead unsigned char so that we can store negative values. */
 typedef short int pixel_t;
@@ -34,29 +39,36 @@ convolution(const pixel_t *in,
             const bool     normalize)
 {
   const int khalf = kn / 2;
-  float min = 0.5;
-  float max = 254.5;
-  float pixel = 0.0;
-  size_t c = 0;
-  int m, n, i, j;
+  const kernel_convolve_t convolve = kernel_convolve(kn);
 
   assert(kn % 2 == 1);
   assert(nx > kn && ny > kn);
 
-  for (m = khalf; m < nx - khalf; m++) {
-    for (n = khalf; n < ny - khalf; n++) {
-      pixel = c = 0;
+  convolve(in + khalf * nx + khalf, nx, out + khalf * nx + khalf, nx, kernel, kn,
+           nx - 2 * khalf, ny - 2 * khalf, normalize);
+}
 
-      for (j = -khalf; j <= khalf; j++)
-        for (i = -khalf; i <= khalf; i++)
-          pixel += in[(n - j) * nx + m - i] * kernel[c++];
+/*
+ * Convolution of the 8-bit luma, mapped to range 0 -> MAX_BRIGHTNESS like
+ * convolution() with normalize set. Reading the frame as it is saves
+ * widening it to pixel_t first.
+ */
+static void
+convolution_u8(const uint8_t *in,
+               pixel_t       *out,
+               const float   *kernel,
+               const int      nx,
+               const int      ny,
+               const int      kn)
+{
+  const int khalf = kn / 2;
+  const kernel_convolve_u8_t convolve = kernel_convolve_u8(kn);
 
-      if (normalize == true)
-        pixel = MAX_BRIGHTNESS * (pixel - min) / (max - min);
+  assert(kn % 2 == 1);
+  assert(nx > kn && ny > kn);
 
-      out[n * nx + m] = (pixel_t) pixel;
-    }
-  }
+  convolve(in + khalf * nx + khalf, nx, out + khalf * nx + khalf, nx, kernel, kn,
+           nx - 2 * khalf, ny - 2 * khalf, true);
 }
 
 /*
@@ -69,14 +81,23 @@ convolution(const pixel_t *in,
  * 2.0 <= sigma < 2.5 : 11
  * 2.5 <= sigma < 3.0 : 13 ...
  * kernel size = 2 * int(2 * sigma) + 3;
+ *
+ * If recursive is true, the recursive filter from iir.h is used instead,
+ * whose cost does not depend on sigma.
  */
 static void
-gaussian_filter(const pixel_t *in,
+gaussian_filter(const uint8_t *in,
                 pixel_t       *out,
                 const int      nx,
                 const int      ny,
-                const float    sigma)
+                const float    sigma,
+                const bool     recursive)
 {
+  if (recursive) {
+    iir_gaussian(in, out, nx, ny, sigma, 1);
+    return;
+  }
+
   const int n = 2 * (int) (2 * sigma) + 3;
   const float mean = (float) floor(n / 2.0);
   float kernel[n * n];
@@ -88,7 +109,33 @@ gaussian_filter(const pixel_t *in,
       kernel[c++] = exp(-0.5 * (pow((i - mean) / sigma, 2.0) + pow((j - mean) / sigma, 2.0))) / (2 * M_PI * sigma * sigma);
   }
 
-  convolution(in, out, kernel, nx, ny, n, true);
+  convolution_u8(in, out, kernel, nx, ny, n);
+}
+
+/*
+ * Whether pixel c is a local maximum of G along its gradient direction.
+ */
+static inline bool
+canny_is_maximum(const pixel_t *G,
+                 const pixel_t *after_Gx,
+                 const pixel_t *after_Gy,
+                 const int      c,
+                 const int      width)
+{
+  const int nn = c - width;
+  const int ss = c + width;
+  const int ww = c + 1;
+  const int ee = c - 1;
+  const int nw = nn + 1;
+  const int ne = nn - 1;
+  const int sw = ss + 1;
+  const int se = ss - 1;
+  const float dir = (float) (fmod(atan2(after_Gy[c], after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
+
+  return ((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
+         ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
+         ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
+         ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]);   // 135 deg
 }
 
 /*
@@ -99,6 +146,9 @@ gaussian_filter(const pixel_t *in,
  * http://www.songho.ca/dsp/cannyedge/cannyedge.html
  *
  * Note: T1 and T2 are lower and upper thresholds.
+ *
+ * Non-maximum suppression classifies the pixels straight into the bit planes
+ * of hysteresis.h, which then grows the edges.
  */
 
 static uint8_t *
@@ -107,11 +157,10 @@ canny_edge_detection(const uint8_t *in,
                      const int      height,
                      const int      t1,
                      const int      t2,
-                     const float    sigma)
+                     const float    sigma,
+                     const bool     recursive)
 {
-  int i, j, k, nedges;
-  int *edges;
-  size_t t = 1;
+  int i, j;
   uint8_t *retval;
 
   const float Gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
@@ -126,21 +175,11 @@ canny_edge_detection(const uint8_t *in,
   pixel_t *after_Gy = calloc(width * height * sizeof(pixel_t), 1);
   DIE(after_Gy == NULL, "calloc");
 
-  pixel_t *nms = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(nms == NULL, "calloc");
-
-  pixel_t *out = malloc(width * height * sizeof(pixel_t));
-  DIE(out == NULL, "malloc");
-
-  pixel_t *pixels = malloc(width * height * sizeof(pixel_t));
-  DIE(pixels == NULL, "malloc");
-
-  /* Convert to pixel_t. */
-  for (i = 0; i < width * height; i++) {
-    pixels[i] = (pixel_t)in[i];
-  }
+  /* Zeroed like the other buffers: the blur leaves its border unwritten. */
+  pixel_t *out = calloc(width * height * sizeof(pixel_t), 1);
+  DIE(out == NULL, "calloc");
 
-  gaussian_filter(pixels, out, width, height, sigma);
+  gaussian_filter(in, out, width, height, sigma, recursive);
 
   convolution(out, after_Gx, Gx, width, height, 3, false);
 
@@ -153,84 +192,32 @@ canny_edge_detection(const uint8_t *in,
     }
   }
 
-  /* Non-maximum suppression, straightforward implementation. */
-  for (i = 1; i < width - 1; i++) {
-    for (j = 1; j < height - 1; j++) {
-      const int c = i + width * j;
-      const int nn = c - width;
-      const int ss = c + width;
-      const int ww = c + 1;
-      const int ee = c - 1;
-      const int nw = nn + 1;
-      const int ne = nn - 1;
-      const int sw = ss + 1;
-      const int se = ss - 1;
-      const float dir = (float) (fmod(atan2(after_Gy[c], after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
-
-      if (((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
-          ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
-          ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
-          ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]))   // 135 deg
-        nms[c] = G[c];
-      else
-        nms[c] = 0;
-    }
-  }
+  hysteresis_t *hy = hysteresis_create(width, height);
 
-  /* Reuse the array used as a stack, width * height / 2 elements should be enough. */
-  edges = (int *) after_Gy;
-  memset(out, 0, sizeof(pixel_t) * width * height);
-  memset(edges, 0, sizeof(pixel_t) * width * height);
-
-  /* Tracing edges with hysteresis. Non-recursive implementation. */
+  /*
+   * Non-maximum suppression. Pixels below T1 are discarded before the
+   * direction is computed.
+   */
   for (j = 1; j < height - 1; j++) {
     for (i = 1; i < width - 1; i++) {
-      /* Trace edges. */
-      if (nms[t] >= t2 && out[t] == 0) {
-        out[t] = MAX_BRIGHTNESS;
-        nedges = 1;
-        edges[0] = t;
-
-        do {
-          nedges--;
-          const int e = edges[nedges];
-
-          int nbs[8]; // neighbours
-          nbs[0] = e - width;     // nn
-          nbs[1] = e + width;     // ss
-          nbs[2] = e + 1;      // ww
-          nbs[3] = e - 1;      // ee
-          nbs[4] = nbs[0] + 1; // nw
-          nbs[5] = nbs[0] - 1; // ne
-          nbs[6] = nbs[1] + 1; // sw
-          nbs[7] = nbs[1] - 1; // se
-
-          for (k = 0; k < 8; k++) {
-            if (nms[nbs[k]] >= t1 && out[nbs[k]] == 0) {
-              out[nbs[k]] = MAX_BRIGHTNESS;
-              edges[nedges] = nbs[k];
-              nedges++;
-            }
-          }
-        } while (nedges > 0);
-      }
-      t++;
+      const int c = i + width * j;
+      const pixel_t nms = G[c] >= t1 && canny_is_maximum(G, after_Gx, after_Gy, c, width) ? G[c] : 0;
+
+      hysteresis_mark(hy, i, j, nms, t1, t2);
     }
   }
 
+  hysteresis_run(hy);
+
   retval = malloc(width * height * sizeof(uint8_t));
   DIE(retval == NULL, "malloc");
 
-  /* Convert back to uint8_t */
-  for (i = 0; i < width * height; i++) {
-    retval[i] = (uint8_t)out[i];
-  }
+  hysteresis_output(hy, retval);
+  hysteresis_free(hy);
 
   free(after_Gx);
   free(after_Gy);
   free(G);
-  free(nms);
-  free(pixels);
   free(out);
 
   return retval;
@@ -239,18 +226,38 @@ canny_edge_detection(const uint8_t *in,
 static void
 print_usage(const char *argv0)
 {
-  fprintf(stderr, "Usage: mpirun -np <NUM> %s <IN.mpg> [OUT.mpg]\n", argv0);
+  fprintf(stderr, "Usage: mpirun -np <NUM> %s [-e EDGES] [-c MODE] [-s SIGMA] [-r] [-g] [-P] [-f RANGE] [-u ROWS] <IN.mpg> [OUT.mpg]\n", argv0);
   fprintf(stderr, "Required arguments:\n"
                   "  <IN.mpg>\tthe input video file\n"
                   "  <NUM>\t\tthe number of threads\n"
                   "Optional arguments:\n"
-                  "  [OUT.mpg]\tthe output video file\n");
+                  "  [OUT.mpg]\tthe output video file\n"
+                  "  -e EDGES\twrite bit-packed edge maps to EDGES instead of encoding\n"
+                  "  -c MODE\tedge map compression: none, rle or delta (default: rle)\n"
+                  "  -s SIGMA\tGaussian blur sigma, at least 0.5 (default: 1.0)\n"
+                  "  -r\t\tuse a recursive Gaussian, whose cost does not depend on sigma\n"
+                  "  -g\t\tencode the edges with constant neutral chroma, cheaper to encode\n"
+                  "  -P\t\tdecode and encode on a codec thread, alongside edge detection\n"
+                  "  -f RANGE\tonly process the frames START:END[:STRIDE], counted from 0,\n"
+                  "    \t\tand stop decoding at END\n"
+                  "  -u ROWS\theight of the work units the workers pull, or the frame\n"
+                  "    \t\theight for whole frames (default: a quarter of a strip, at\n"
+                  "    \t\tleast 80 rows and a multiple of 20)\n");
 }
 
 int main(int argc, char **argv)
 {
   const char *file_in;
   const char *file_out;
+  const char *file_edges = NULL;
+  int compression = EDGEMAP_RLE;
+  float sigma = CANNY_SIGMA;
+  bool recursive = false;
+  bool gray = false;
+  bool pipelined = false;
+  int unit_rows = 0;
+  frames_t frames = FRAMES_ALL;
+  int opt;
 
   int num_tasks, rank;
   int num_workers, master_id;
@@ -262,13 +269,60 @@ int main(int argc, char **argv)
   struct timespec start, end;
   double time_per_frame, computational_time = 0;
 
-  if (argc < 2 || argc > 3) {
+  while ((opt = getopt(argc, argv, "e:c:s:rgPf:u:")) != -1) {
+    switch (opt) {
+    case 'e':
+      file_edges = optarg;
+      break;
+    case 'c':
+      compression = edgemap_parse_compression(optarg);
+      if (compression < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 's':
+      sigma = atof(optarg);
+      if (sigma < 0.5) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'r':
+      recursive = true;
+      break;
+    case 'g':
+      gray = true;
+      break;
+    case 'P':
+      pipelined = true;
+      break;
+    case 'f':
+      if (frames_parse(&frames, optarg) < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'u':
+      unit_rows = atoi(optarg);
+      if (unit_rows < 1) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (argc - optind < 1 || argc - optind > 2) {
     print_usage(argv[0]);
     exit(1);
   }
 
-  file_in = argv[1];
-  file_out = argc == 3 ? argv[2] : "out.mpg";
+  file_in = argv[optind];
+  file_out = argc - optind == 2 ? argv[optind + 1] : "out.mpg";
 
   MPI_Init(&argc, &argv);
   MPI_Comm_size(MPI_COMM_WORLD, &num_tasks);
@@ -281,73 +335,43 @@ int main(int argc, char **argv)
   if (rank == master_id) {
     DeContext *context;
     DeFrame *frame = NULL;
+    codec_t codec;
+    char tag[16];
+    edgemap_t *edgemap = NULL;
+    pull_t pull;
+    long frame_index = 0;
     int got_frame = 0;
-    int chunk_height, chunk_size, chunk_start, chunk_size_edge;
-    int i, worker_id;
 
     context = de_context_create(file_in);
-    de_context_prepare_encoding(context, file_out);
 
-    do {
-      frame = de_context_get_next_frame(context, &got_frame);
+    /* The edge map sink replaces the encoder entirely. */
+    if (file_edges)
+      edgemap = edgemap_create(file_edges, compression);
+    else
+      de_context_prepare_encoding(context, file_out);
 
-      if (got_frame == -1) {
-        size_buffer[0] = size_buffer[1] = 0;
+    pull_init(&pull, num_workers, unit_rows, buffer, BUFFSIZE);
+    codec_init(&codec, context, pipelined);
 
-        for (i = 0; i < num_workers; i++)
-          MPI_Send(size_buffer, 2, MPI_INT, i, TAG_SIZE, MPI_COMM_WORLD);
+    do {
+      if (frames_done(&frames, frame_index))
+        got_frame = -1;
+      else
+        frame = codec_get_next_frame(&codec, &got_frame);
 
+      if (got_frame == -1) {
+        pull_stop(&pull);
         break;
       }
 
+      if (got_frame && frame && !frames_selected(&frames, frame_index++))
+        continue;
+
       if (got_frame && frame) {
         DIE(clock_gettime(CLOCK_MONOTONIC, &start) == -1, "clock_gettime");
 
-        chunk_height = frame->height / num_workers;
-        chunk_start = (chunk_height - CORRECTION) * frame->width;
-        chunk_size = (chunk_height + CORRECTION * 2) * frame->width;
-        chunk_size_edge = (chunk_height + CORRECTION) * frame->width;
-
-        size_buffer[0] = frame->width;
-        size_buffer[1] = chunk_height + CORRECTION;
-
-        /* Send to first worker */
-        MPI_Send(size_buffer, 2, MPI_INT, 0, TAG_SIZE, MPI_COMM_WORLD);
-        memcpy(buffer, frame->data + 0, chunk_size_edge);
-        MPI_Send(buffer, chunk_size_edge, MPI_UNSIGNED_CHAR, 0, TAG_WORK, MPI_COMM_WORLD);
-
-        /* Send to last worker */
-        MPI_Send(size_buffer, 2, MPI_INT, num_workers - 1, TAG_SIZE, MPI_COMM_WORLD);
-        memcpy(buffer, frame->data + ((num_workers - 1) * chunk_start), chunk_size_edge);
-        MPI_Send(buffer, chunk_size_edge, MPI_UNSIGNED_CHAR, num_workers - 1, TAG_WORK, MPI_COMM_WORLD);
-
-        size_buffer[1] = chunk_height + CORRECTION * 2;
-
-        /* Split the frame in blocks and send one block to each worker. */
-        for (i = 1; i < num_workers - 1; i++) {
-            MPI_Send(size_buffer, 2, MPI_INT, i, TAG_SIZE, MPI_COMM_WORLD);
-
-            /* Send the actual block. */
-            memcpy(buffer, frame->data + (i * chunk_start), chunk_size);
-            MPI_Send(buffer, chunk_size, MPI_UNSIGNED_CHAR, i, TAG_WORK, MPI_COMM_WORLD);
-        }
-
-        /* Get from first worker */
-        printf("Receiving from first\n");
-        MPI_Recv(buffer, chunk_size_edge, MPI_UNSIGNED_CHAR, 0, TAG_WORK, MPI_COMM_WORLD, &status);
-        memcpy(frame->frame->data[0] + 0, buffer, frame->width * chunk_height);
-
-        /* Get from last worker */
-        MPI_Recv(buffer, chunk_size_edge, MPI_UNSIGNED_CHAR, num_workers - 1, TAG_WORK, MPI_COMM_WORLD, &status);
-        memcpy(frame->frame->data[0] + ((num_workers - 1) * frame->width * chunk_height), buffer + frame->width * CORRECTION, frame->width * chunk_height);
-
-        /* Receive the computed blocks from workers. */
-        for (i = 1; i < num_workers - 1; i++) {
-          MPI_Recv(buffer, chunk_size, MPI_UNSIGNED_CHAR, MPI_ANY_SOURCE, TAG_WORK, MPI_COMM_WORLD, &status);
-          worker_id = status.MPI_SOURCE;
-
-          memcpy(frame->frame->data[0] + (worker_id * frame->width * chunk_height), buffer + frame->width * CORRECTION, frame->width * chunk_height);
-        }
+        /* The workers pull the units of the frame until all are back. */
+        pull_frame(&pull, frame->data, frame->frame->data[0], frame->width, frame->height);
 
         DIE(clock_gettime(CLOCK_MONOTONIC, &end) == -1, "clock_gettime");
 
@@ -355,20 +379,35 @@ int main(int argc, char **argv)
         printf("[%d] Time per frame: %lf\n", rank, time_per_frame);
         computational_time += time_per_frame;
 
-        de_context_set_next_frame(context, frame);
+        if (edgemap)
+          edgemap_write_frame(edgemap, frame->frame->data[0], frame->width, frame->height);
+        else {
+          if (gray)
+            codec_neutral_chroma(frame->frame, frame->height);
+          codec_set_next_frame(&codec, frame);
+        }
       }
     } while (1);
 
+    codec_finish(&codec);
+
+    if (edgemap)
+      edgemap_close(edgemap);
+    else
+      CODEC_TIMED(codec.time, de_context_end_encoding(context));
+
+    snprintf(tag, sizeof(tag), "[%d] ", rank);
+    codec_report(&codec, stdout, tag);
     printf("[%d] Computational time: %lf\n", rank, computational_time);
 
-    de_context_end_encoding(context);
+    pull_free(&pull);
   } else {
     int block_width, block_height;
 
     /* Receive frame blocks from master and apply canny edge detection on them. */
     while (true) {
       /* Receive the block's width and height. */
-      MPI_Recv(size_buffer, 2, MPI_INT, master_id, TAG_SIZE, MPI_COMM_WORLD, &status);
+      MPI_Recv(size_buffer, 2, MPI_INT, master_id, PULL_TAG_SIZE, MPI_COMM_WORLD, &status);
 
       block_width = size_buffer[0];
       block_height = size_buffer[1];
@@ -382,10 +421,10 @@ int main(int argc, char **argv)
 
       /* Apply canny edge detection. */
       uint8_t *computed = canny_edge_detection(buffer, block_width, block_height,
-                                               CANNY_UPPER, CANNY_UPPER, CANNY_SIGMA);
+                                               CANNY_UPPER, CANNY_UPPER, sigma, recursive);
 
-      /* Send the block back to master. */
-      MPI_Send(computed, block_width * block_height, MPI_UNSIGNED_CHAR, master_id, TAG_WORK, MPI_COMM_WORLD);
+      /* Send the block back to master, which asks for the next one. */
+      MPI_Send(computed, block_width * block_height, MPI_UNSIGNED_CHAR, master_id, PULL_TAG_WORK, MPI_COMM_WORLD);
 
       free(computed);
     }
@@ -1,11 +1,42 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <omp.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "../libde/de.h"
+#include "adaptive.h"
+#include "affinity.h"
+#include "codec.h"
+#include "contours.h"
+#include "cores.h"
+#include "deadline.h"
+#include "edgemap.h"
+#include "frames.h"
+#include "hysteresis.h"
+#include "iir.h"
+#include "incremental.h"
+#include "kernels.h"
+#include "motion.h"
+#include "preview.h"
+#include "roi.h"
+#include "scratch.h"
+#include "stream.h"
+#include "sweep.h"
 #include "utils.h"
 
 #define MAX_BRIGHTNESS 255
@@ -30,30 +61,45 @@ convolution(const pixel_t *in,
             const int      nthreads)
 {
   const int khalf = kn / 2;
-  float min = 0.5;
-  float max = 254.5;
-  float pixel = 0.0;
-  size_t c = 0;
-  int m, n, i, j;
+  const kernel_convolve_t convolve = kernel_convolve(kn);
+  int n;
 
   assert(kn % 2 == 1);
   assert(nx > kn && ny > kn);
 
-  #pragma omp parallel for private(m, n, pixel, c, i, j) shared(out, min, max) num_threads(nthreads) collapse(2)
-  for (m = khalf; m < nx - khalf; m++) {
-    for (n = khalf; n < ny - khalf; n++) {
-      pixel = c = 0;
+  /* A row per iteration, with the kernel size dispatched once per frame. */
+  #pragma omp parallel for num_threads(nthreads) schedule(static)
+  for (n = khalf; n < ny - khalf; n++)
+    convolve(in + n * nx + khalf, nx, out + n * nx + khalf, nx, kernel, kn,
+             nx - 2 * khalf, 1, normalize);
+}
 
-      for (j = -khalf; j <= khalf; j++)
-        for (i = -khalf; i <= khalf; i++)
-          pixel += in[(n - j) * nx + m - i] * kernel[c++];
+/*
+ * Convolution of the 8-bit luma, mapped to range 0 -> MAX_BRIGHTNESS like
+ * convolution() with normalize set. Reading the frame as it is saves
+ * widening it to pixel_t first.
+ */
+static void
+convolution_u8(const uint8_t *in,
+               pixel_t       *out,
+               const float   *kernel,
+               const int      nx,
+               const int      ny,
+               const int      kn,
+               const int      nthreads)
+{
+  const int khalf = kn / 2;
+  const kernel_convolve_u8_t convolve = kernel_convolve_u8(kn);
+  int n;
 
-      if (normalize == true)
-        pixel = MAX_BRIGHTNESS * (pixel - min) / (max - min);
+  assert(kn % 2 == 1);
+  assert(nx > kn && ny > kn);
 
-      out[n * nx + m] = (pixel_t) pixel;
-    }
-  }
+  /* A row per iteration, with the kernel size dispatched once per frame. */
+  #pragma omp parallel for num_threads(nthreads) schedule(static)
+  for (n = khalf; n < ny - khalf; n++)
+    convolve(in + n * nx + khalf, nx, out + n * nx + khalf, nx, kernel, kn,
+             nx - 2 * khalf, 1, true);
 }
 
 /*
@@ -66,15 +112,24 @@ convolution(const pixel_t *in,
  * 2.0 <= sigma < 2.5 : 11
  * 2.5 <= sigma < 3.0 : 13 ...
  * kernel size = 2 * int(2 * sigma) + 3;
+ *
+ * If recursive is true, the recursive filter from iir.h is used instead,
+ * whose cost does not depend on sigma.
  */
 static void
-gaussian_filter(const pixel_t *in,
+gaussian_filter(const uint8_t *in,
                 pixel_t       *out,
                 const int      nx,
                 const int      ny,
                 const float    sigma,
+                const bool     recursive,
                 const int      nthreads)
 {
+  if (recursive) {
+    iir_gaussian(in, out, nx, ny, sigma, nthreads);
+    return;
+  }
+
   const int n = 2 * (int) (2 * sigma) + 3;
   const float mean = (float) floor(n / 2.0);
   float kernel[n * n];
@@ -86,7 +141,7 @@ gaussian_filter(const pixel_t *in,
       kernel[c++] = exp(-0.5 * (pow((i - mean) / sigma, 2.0) + pow((j - mean) / sigma, 2.0))) / (2 * M_PI * sigma * sigma);
   }
 
-  convolution(in, out, kernel, nx, ny, n, true, nthreads);
+  convolution_u8(in, out, kernel, nx, ny, n, nthreads);
 }
 
 /*
@@ -96,94 +151,193 @@ gaussian_filter(const pixel_t *in,
  * http://fourier.eng.hmc.edu/e161/lectures/canny/node1.html
  * http://www.songho.ca/dsp/cannyedge/cannyedge.html
  *
- * Note: T1 and T2 are lower and upper thresholds.
+ * The first stage (blur, Sobel and gradient magnitude) does not depend on the
+ * thresholds; the second thins the gradient with non-maximum suppression and
+ * traces edges with hysteresis, so that several threshold pairs can share one
+ * first stage.
  */
 
-static uint8_t *
-canny_edge_detection(const uint8_t *in,
-                     const int      width,
-                     const int      height,
-                     const int      t1,
-                     const int      t2,
-                     const float    sigma,
-                     const int      nthreads)
+typedef struct {
+  pixel_t *G;
+  pixel_t *after_Gx;
+  pixel_t *after_Gy;
+} gradient_t;
+
+/*
+ * A sigma of 0 skips the blur, for input that is already smoothed. If hist is
+ * not NULL, the gradient magnitudes are also counted into its ADAPTIVE_BINS
+ * bins.
+ */
+static gradient_t
+canny_gradient(const uint8_t *in,
+               const int      width,
+               const int      height,
+               const float    sigma,
+               const bool     recursive,
+               const int      nthreads,
+               unsigned int  *hist)
 {
-  int i, j, k, nedges;
-  int *edges;
-  size_t t = 1;
-  uint8_t *retval;
+  gradient_t g;
+  int i, j;
 
   const float Gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
   const float Gy[] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
 
-  pixel_t *G = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(G == NULL, "calloc");
-
-  pixel_t *after_Gx = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(after_Gx == NULL, "calloc");
+  /* Every row is first touched by the thread that computes it. */
+  g.G = scratch_alloc(height, width * sizeof(pixel_t), nthreads);
+  g.after_Gx = scratch_alloc(height, width * sizeof(pixel_t), nthreads);
+  g.after_Gy = scratch_alloc(height, width * sizeof(pixel_t), nthreads);
+  pixel_t *out = scratch_alloc(height, width * sizeof(pixel_t), nthreads);
 
-  pixel_t *after_Gy = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(after_Gy == NULL, "calloc");
+  if (sigma > 0)
+    gaussian_filter(in, out, width, height, sigma, recursive, nthreads);
+  else
+    for (i = 0; i < width * height; i++)
+      out[i] = (pixel_t)in[i];
 
-  pixel_t *nms = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(nms == NULL, "calloc");
+  convolution(out, g.after_Gx, Gx, width, height, 3, false, nthreads);
 
-  pixel_t *out = malloc(width * height * sizeof(pixel_t));
-  DIE(out == NULL, "malloc");
+  convolution(out, g.after_Gy, Gy, width, height, 3, false, nthreads);
 
-  pixel_t *pixels = malloc(width * height * sizeof(pixel_t));
-  DIE(pixels == NULL, "malloc");
+  pixel_t *G = g.G;
+  const pixel_t *after_Gx = g.after_Gx;
+  const pixel_t *after_Gy = g.after_Gy;
 
-  /* Convert to pixel_t. */
-  for (i = 0; i < width * height; i++) {
-    pixels[i] = (pixel_t)in[i];
+  if (hist) {
+    /* Every thread fills its own copy of the histogram, summed at the end. */
+    #pragma omp parallel for private(i, j) shared(G) reduction(+:hist[:ADAPTIVE_BINS]) num_threads(nthreads) schedule(static)
+    for (j = 1; j < height - 1; j++) {
+      for (i = 1; i < width - 1; i++) {
+        const int c = i + width * j;
+        G[c] = (pixel_t)hypot(after_Gx[c], after_Gy[c]);
+        hist[adaptive_bin(G[c])]++;
+      }
+    }
+  } else {
+    #pragma omp parallel for private(i, j) shared(G) num_threads(nthreads) schedule(static)
+    for (j = 1; j < height - 1; j++) {
+      for (i = 1; i < width - 1; i++) {
+        const int c = i + width * j;
+        G[c] = (pixel_t)hypot(after_Gx[c], after_Gy[c]);
+      }
+    }
   }
 
-  gaussian_filter(pixels, out, width, height, sigma, nthreads);
+  scratch_free(out);
 
-  convolution(out, after_Gx, Gx, width, height, 3, false, nthreads);
+  return g;
+}
 
-  convolution(out, after_Gy, Gy, width, height, 3, false, nthreads);
+static void
+gradient_free(gradient_t *g)
+{
+  scratch_free(g->G);
+  scratch_free(g->after_Gx);
+  scratch_free(g->after_Gy);
+}
 
-  #pragma omp parallel for private(i, j) shared(G) num_threads(nthreads) collapse(2)
-  for (i = 1; i < width - 1; i++) {
-    for (j = 1; j < height - 1; j++) {
+/*
+ * Whether pixel c is a local maximum along its gradient direction.
+ */
+static inline bool
+canny_is_maximum(const gradient_t *g, const int c, const int width)
+{
+  const pixel_t *G = g->G;
+  const int nn = c - width;
+  const int ss = c + width;
+  const int ww = c + 1;
+  const int ee = c - 1;
+  const int nw = nn + 1;
+  const int ne = nn - 1;
+  const int sw = ss + 1;
+  const int se = ss - 1;
+  const float dir = (float) (fmod(atan2(g->after_Gy[c], g->after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
+
+  return ((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
+         ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
+         ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
+         ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]);   // 135 deg
+}
+
+/*
+ * Non-maximum suppression, straightforward implementation. Returns the
+ * magnitude of the local maxima, 0 elsewhere.
+ */
+static pixel_t *
+canny_non_maximum_suppression(const gradient_t *g,
+                              const int         width,
+                              const int         height,
+                              const int         nthreads)
+{
+  int i, j;
+
+  pixel_t *nms = scratch_alloc(height, width * sizeof(pixel_t), nthreads);
+
+  #pragma omp parallel for private(i, j) shared(nms) num_threads(nthreads) schedule(static)
+  for (j = 1; j < height - 1; j++) {
+    for (i = 1; i < width - 1; i++) {
       const int c = i + width * j;
-      G[c] = (pixel_t)hypot(after_Gx[c], after_Gy[c]);
+      nms[c] = canny_is_maximum(g, c, width) ? g->G[c] : 0;
     }
   }
 
-  /* Non-maximum suppression, straightforward implementation. */
-  #pragma omp parallel for private(i, j) shared(nms) num_threads(nthreads) collapse(2)
-  for (i = 1; i < width - 1; i++) {
-    for (j = 1; j < height - 1; j++) {
+  return nms;
+}
+
+/*
+ * Non-maximum suppression that classifies every pixel straight into the bit
+ * planes of hy. Pixels below T1 are discarded before the direction is even
+ * computed. Each row is classified by a single thread, as hysteresis_mark()
+ * requires.
+ */
+static void
+canny_classify(const gradient_t *g,
+               const int         width,
+               const int         height,
+               const int         t1,
+               const int         t2,
+               const int         nthreads,
+               hysteresis_t     *hy)
+{
+  int i, j;
+
+  #pragma omp parallel for private(i, j) num_threads(nthreads) schedule(static)
+  for (j = 1; j < height - 1; j++) {
+    for (i = 1; i < width - 1; i++) {
       const int c = i + width * j;
-      const int nn = c - width;
-      const int ss = c + width;
-      const int ww = c + 1;
-      const int ee = c - 1;
-      const int nw = nn + 1;
-      const int ne = nn - 1;
-      const int sw = ss + 1;
-      const int se = ss - 1;
-      const float dir = (float) (fmod(atan2(after_Gy[c], after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
-
-      if (((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
-          ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
-          ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
-          ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]))   // 135 deg
-        nms[c] = G[c];
-      else
-        nms[c] = 0;
+      const pixel_t nms = g->G[c] >= t1 && canny_is_maximum(g, c, width) ? g->G[c] : 0;
+
+      hysteresis_mark(hy, i, j, nms, t1, t2);
     }
   }
+}
 
-  /* Reuse the array used as a stack, width * height / 2 elements should be enough. */
-  edges = (int *) after_Gy;
-  memset(out, 0, sizeof(pixel_t) * width * height);
-  memset(edges, 0, sizeof(pixel_t) * width * height);
+/*
+ * Tracing edges with hysteresis, one edge at a time, so that the edges can be
+ * recorded as contours in tracing order.
+ *
+ * Note: T1 and T2 are lower and upper thresholds.
+ */
+static uint8_t *
+canny_trace(const pixel_t *nms,
+            const int      width,
+            const int      height,
+            const int      t1,
+            const int      t2,
+            contours_t    *contours)
+{
+  int i, j, k, nedges;
+  int *edges;
+  size_t t = 1;
+
+  uint8_t *out = calloc(width * height * sizeof(uint8_t), 1);
+  DIE(out == NULL, "calloc");
 
-  /* Tracing edges with hysteresis. Non-recursive implementation. */
+  /* Used as a stack; a pixel is pushed at most once. */
+  edges = malloc(width * height * sizeof(int));
+  DIE(edges == NULL, "malloc");
+
+  /* Non-recursive implementation. */
   for (j = 1; j < height - 1; j++) {
     for (i = 1; i < width - 1; i++) {
       /* Trace edges. */
@@ -192,10 +346,14 @@ canny_edge_detection(const uint8_t *in,
         nedges = 1;
         edges[0] = t;
 
+        contours_begin(contours);
+
         do {
           nedges--;
           const int e = edges[nedges];
 
+          contours_add(contours, e);
+
           int nbs[8]; // neighbours
           nbs[0] = e - width;     // nn
           nbs[1] = e + width;     // ss
@@ -207,7 +365,8 @@ canny_edge_detection(const uint8_t *in,
           nbs[7] = nbs[1] - 1; // se
 
           for (k = 0; k < 8; k++) {
-            if (nms[nbs[k]] >= t1 && out[nbs[k]] == 0) {
+            if (hysteresis_interior(nbs[k], width, height) &&
+                nms[nbs[k]] >= t1 && out[nbs[k]] == 0) {
               out[nbs[k]] = MAX_BRIGHTNESS;
               edges[nedges] = nbs[k];
               nedges++;
@@ -219,20 +378,63 @@ canny_edge_detection(const uint8_t *in,
     }
   }
 
-  retval = malloc(width * height * sizeof(uint8_t));
-  DIE(retval == NULL, "malloc");
+  free(edges);
+
+  return out;
+}
+
+/*
+ * Edges of an already computed gradient. If contours is not NULL, every
+ * traced edge is also recorded as a contour; otherwise the bit-packed
+ * hysteresis is used.
+ */
+static uint8_t *
+canny_edges(const gradient_t *g,
+            const int         width,
+            const int         height,
+            const int         t1,
+            const int         t2,
+            const int         nthreads,
+            contours_t       *contours)
+{
+  uint8_t *retval;
+
+  if (contours) {
+    pixel_t *nms = canny_non_maximum_suppression(g, width, height, nthreads);
+
+    retval = canny_trace(nms, width, height, t1, t2, contours);
+    scratch_free(nms);
+  } else {
+    hysteresis_t *hy = hysteresis_create(width, height);
+
+    canny_classify(g, width, height, t1, t2, nthreads, hy);
+    hysteresis_run(hy);
 
-  /* Convert back to uint8_t */
-  for (i = 0; i < width * height; i++) {
-    retval[i] = (uint8_t)out[i];
+    retval = malloc(width * height * sizeof(uint8_t));
+    DIE(retval == NULL, "malloc");
+
+    hysteresis_output(hy, retval);
+    hysteresis_free(hy);
   }
 
-  free(after_Gx);
-  free(after_Gy);
-  free(G);
-  free(nms);
-  free(pixels);
-  free(out);
+  return retval;
+}
+
+static uint8_t *
+canny_edge_detection(const uint8_t *in,
+                     const int      width,
+                     const int      height,
+                     const int      t1,
+                     const int      t2,
+                     const float    sigma,
+                     const bool     recursive,
+                     const int      nthreads,
+                     contours_t    *contours)
+{
+  gradient_t g = canny_gradient(in, width, height, sigma, recursive, nthreads, NULL);
+  uint8_t *retval = canny_edges(&g, width, height, t1, t2, nthreads, contours);
+
+  gradient_free(&g);
 
   return retval;
 }
@@ -240,63 +442,941 @@ canny_edge_detection(const uint8_t *in,
 static void
 print_usage(const char *argv0)
 {
-  fprintf(stderr, "Usage: %s <IN.mpg> <NUM> [OUT.mpg]\n", argv0);
+  fprintf(stderr, "Usage: %s [-e EDGES] [-c MODE] [-o CONTOURS] [-i] [-m] [-p FACTOR] [-s SIGMA] [-r] [-t LIST] [-a MODE] [-l] [-g] [-P] [-f RANGE] [-R ROI] [-T FPS] [-F FPS] [-b CPUS] [-H] <IN.mpg> <NUM> [OUT.mpg]\n"
+                  "       %s -D SOCKET [-b CPUS] [-H] <NUM>\n"
+                  "       %s -B OUTDIR [OPTIONS] <NUM> <IN.mpg>...\n", argv0, argv0, argv0);
   fprintf(stderr, "Required arguments:\n"
                   "  <IN.mpg>\tthe input video file\n"
                   "  <NUM>\t\tthe number of threads\n"
                   "Optional arguments:\n"
-                  "  [OUT.mpg]\tthe output video file\n");
+                  "  [OUT.mpg]\tthe output video file\n"
+                  "  -e EDGES\twrite bit-packed edge maps to EDGES instead of encoding\n"
+                  "  -c MODE\tedge map compression: none, rle or delta (default: rle)\n"
+                  "  -o CONTOURS\twrite the traced edge contours to CONTOURS\n"
+                  "  -i\t\tonly reprocess the regions that changed since the previous frame\n"
+                  "  -m\t\tlike -i, but trust the decoder's motion vectors to skip still\n"
+                  "    \t\tmacroblocks (approximate, needs a decoder exporting them)\n"
+                  "  -p FACTOR\tfast preview: detect edges on the frame downscaled by 2 or 4\n"
+                  "  -s SIGMA\tGaussian blur sigma, at least 0.5 (default: 1.0)\n"
+                  "  -r\t\tuse a recursive Gaussian, whose cost does not depend on sigma\n"
+                  "  -t LIST\tthreshold sweep: trace every LOWER:UPPER pair of the comma-\n"
+                  "    \t\tseparated LIST, writing each to EDGES.LOWER-UPPER (needs -e)\n"
+                  "  -a MODE\tpick the thresholds of every frame from its gradient histogram:\n"
+                  "    \t\totsu, or the percentile of the upper threshold (1 to 99)\n"
+                  "  -l\t\tstream every frame row by row through rolling line buffers\n"
+                  "  -g\t\tencode the edges with constant neutral chroma, cheaper to encode\n"
+                  "  -P\t\tdecode and encode on a codec thread, alongside edge detection\n"
+                  "  -f RANGE\tonly process the frames START:END[:STRIDE], counted from 0,\n"
+                  "    \t\tand stop decoding at END\n"
+                  "  -R ROI\tonly detect edges in ROI, rectangles WxH+X+Y[,...] or a PGM mask\n"
+                  "  -T FPS\treal time: keep up with FPS frames per second, raising the\n"
+                  "    \t\tthreads up to NUM, then lowering the detail, when behind\n"
+                  "  -F FPS\tuse as few of the NUM threads as keep up with FPS frames\n"
+                  "    \t\tper second\n"
+                  "  -b CPUS\tpin the threads: compact, scatter or a CPU list like 0-7,16-23\n"
+                  "  -H\t\tback the frame buffers with 2 MB huge pages where possible\n"
+                  "  -D SOCKET\trun as a daemon, taking jobs from the client on SOCKET\n"
+                  "  -B OUTDIR\tbatch: run every input on one shared pool of NUM threads,\n"
+                  "    \t\twriting to OUTDIR (-e EXT writes edge maps named IN.EXT)\n");
 }
 
-int main(int argc, char **argv)
+/*
+ * Threads of a batch, shared out between the videos in progress.
+ */
+typedef struct {
+  int nthreads;
+  int slots;
+  int *running;             // per slot, whether it has a video in progress
+} batch_t;
+
+/*
+ * The share of the batch's threads of the video in slot: an equal share of
+ * them between the videos in progress, one more for the first ones if that
+ * does not divide. So once no input is left, the threads of every video
+ * that finishes go to the others, from their next frame on.
+ */
+static int
+batch_threads(const batch_t *b, const int slot)
 {
+  int running = 0, rank = 0, r, s;
+
+  for (s = 0; s < b->slots; s++) {
+    #pragma omp atomic read
+    r = b->running[s];
+
+    if (r) {
+      running++;
+      rank += s < slot;
+    }
+  }
+
+  if (running == 0)
+    return b->nthreads;
+
+  return b->nthreads / running + (rank < b->nthreads % running);
+}
+
+/*
+ * One video to process, from the command line or from a daemon client.
+ */
+typedef struct {
   const char *file_in;
   const char *file_out;
+  const char *file_edges;
+  const char *file_contours;
+  int compression;
+  bool incremental;
+  bool use_motion;
+  bool streaming;
+  bool gray;
+  bool pipelined;
+  int preview;
+  float sigma;
+  bool recursive;
+  int lower;
+  int upper;
+  int adaptive;
+  sweep_t sweep;
+  frames_t frames;
+  roi_t roi;
+  double fps;               // real-time target, 0 for none
+  double throughput;        // frames per second to use as few threads for, 0 for all
+  const char *name;         // prefixes the output of batch jobs
+  batch_t *pool;            // of a batch job, which takes its share of it
+  int slot;
+
+  /* Process-wide, so only from the command line. */
+  const char *cpus;
+  bool huge;
+  const char *socket;
+  const char *batch;
+} job_t;
+
+/*
+ * Parse the options of argv into job, leaving optind on the first operand.
+ * Returns 0 on success, -1 after printing the usage.
+ */
+static int
+job_parse(job_t *job, int argc, char **argv)
+{
+  int opt;
+
+  *job = (job_t) {
+    .compression = EDGEMAP_RLE,
+    .preview = 1,
+    .sigma = CANNY_SIGMA,
+    .lower = CANNY_LOWER,
+    .upper = CANNY_UPPER,
+    .adaptive = -1,
+    .frames = FRAMES_ALL,
+  };
+
+  /* Start over, for every daemon job. */
+  optind = 0;
+
+  while ((opt = getopt(argc, argv, "e:c:o:imp:s:rt:a:lgPf:R:T:F:b:HD:B:")) != -1) {
+    switch (opt) {
+    case 'e':
+      job->file_edges = optarg;
+      break;
+    case 'c':
+      job->compression = edgemap_parse_compression(optarg);
+      if (job->compression < 0) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'o':
+      job->file_contours = optarg;
+      break;
+    case 'i':
+      job->incremental = true;
+      break;
+    case 'm':
+      job->incremental = job->use_motion = true;
+      break;
+    case 'p':
+      job->preview = atoi(optarg);
+      if (job->preview != 2 && job->preview != 4) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 's':
+      job->sigma = atof(optarg);
+      if (job->sigma < 0.5) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'r':
+      job->recursive = true;
+      break;
+    case 'a':
+      job->adaptive = adaptive_parse(optarg);
+      if (job->adaptive < 0) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 't':
+      if (sweep_parse(&job->sweep, optarg) < 0) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'l':
+      job->streaming = true;
+      break;
+    case 'g':
+      job->gray = true;
+      break;
+    case 'P':
+      job->pipelined = true;
+      break;
+    case 'f':
+      if (frames_parse(&job->frames, optarg) < 0) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'R':
+      if (roi_parse(&job->roi, optarg) < 0) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'T':
+      job->fps = atof(optarg);
+      if (job->fps <= 0) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'F':
+      job->throughput = atof(optarg);
+      if (job->throughput <= 0) {
+        print_usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'b':
+      job->cpus = optarg;
+      break;
+    case 'H':
+      job->huge = true;
+      break;
+    case 'D':
+      job->socket = optarg;
+      break;
+    case 'B':
+      job->batch = optarg;
+      break;
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  /* The incremental tracer does not record contours nor downscale. */
+  if (job->incremental && (job->file_contours || job->preview > 1)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* Both the incremental engine and the preview blur with a kernel. */
+  if (job->recursive && (job->incremental || job->preview > 1)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* Every pair gets its own edge map file, and only the plain pipeline is swept. */
+  if (job->sweep.n > 0 && (job->file_edges == NULL || job->incremental || job->preview > 1 ||
+                           job->file_contours)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* Adaptive thresholds replace both the fixed and the swept ones. */
+  if (job->adaptive >= 0 && (job->incremental || job->preview > 1 || job->sweep.n > 0)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* Streaming runs the plain pipeline only, with the direct Gaussian. */
+  if (job->streaming && (job->incremental || job->preview > 1 || job->recursive ||
+                         job->sweep.n > 0 || job->adaptive >= 0 || job->file_contours)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* Motion vectors refer to the previous decoded frame, not to the previous selected one. */
+  if (job->use_motion && job->frames.stride > 1) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* The region is applied by the incremental engine, with the same limits. */
+  if (roi_active(&job->roi) && (job->file_contours || job->preview > 1 || job->recursive ||
+                                job->sweep.n > 0 || job->adaptive >= 0 || job->streaming)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* Real time switches between the plain pipeline and the preview on its own. */
+  if (job->fps > 0 && (job->incremental || job->streaming || job->preview > 1 || job->recursive ||
+                       job->sweep.n > 0 || job->adaptive >= 0 || job->file_contours ||
+                       roi_active(&job->roi))) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* Real time picks the threads itself. */
+  if (job->fps > 0 && job->throughput > 0) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  /* Every input of a batch gets its own files in the output directory. */
+  if (job->batch && (job->socket || job->file_contours || job->sweep.n > 0)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  if (job->preview > 1) {
+    const float scale = preview_threshold_scale(job->sigma, job->preview);
+
+    job->lower = (int) (CANNY_LOWER * scale + 0.5);
+    job->upper = (int) (CANNY_UPPER * scale + 0.5);
+  }
+
+  return 0;
+}
+
+static void
+job_run(const job_t *job, const int nthreads)
+{
+  const char *file_in = job->file_in;
+  const char *file_out = job->file_out;
+  const char *file_edges = job->file_edges;
+  const char *file_contours = job->file_contours;
+  const int compression = job->compression;
+  const bool incremental = job->incremental;
+  const bool use_motion = job->use_motion;
+  const bool streaming = job->streaming;
+  const bool realtime = job->fps > 0;
+  int preview = job->preview;
+  const float sigma = job->sigma;
+  const bool recursive = job->recursive;
+  const int adaptive = job->adaptive;
+  int lower = job->lower;
+  int upper = job->upper;
+  sweep_t sweep = job->sweep;
+  const frames_t frames = job->frames;
+  const roi_t roi = job->roi;
+  deadline_t deadline;
+  cores_t cores;
+  int threads = nthreads;
 
   DeContext *context;
   DeFrame *frame = NULL;
+  codec_t codec;
+  edgemap_t *edgemap = NULL;
+  contours_t contours = {0};
+  FILE *contours_file = NULL;
+  incremental_t *inc = NULL;
+  stream_t *stream = NULL;
+  motion_t *motion = NULL;
+  uint8_t *swept[SWEEP_MAX];
+  uint8_t *edges, *small = NULL, *last = NULL;
+  long frame_index = 0;
   int got_frame = 0;
-  int nthreads;
 
   double start, end;
   double time_per_frame, computational_time = 0;
 
-  if (argc < 3 || argc > 4) {
-    print_usage(argv[0]);
-    exit(1);
+  char tag[NAME_MAX + 4] = "";
+  if (job->name)
+    snprintf(tag, sizeof(tag), "[%s] ", job->name);
+
+  /* Batch jobs open and close their contexts concurrently. */
+  #pragma omp critical(libde)
+  context = de_context_create(file_in);
+
+  /* The edge map sink replaces the encoder entirely. */
+  if (sweep.n > 0)
+    sweep_create(&sweep, file_edges, compression);
+  else if (file_edges)
+    edgemap = edgemap_create(file_edges, compression);
+  else {
+    #pragma omp critical(libde)
+    de_context_prepare_encoding(context, file_out);
   }
 
-  file_in = argv[1];
-  nthreads = atoi(argv[2]);
-  file_out = argc == 4 ? argv[3] : "out.mpg";
+  if (file_contours)
+    contours_file = contours_create(file_contours);
 
-  context = de_context_create(file_in);
-  de_context_prepare_encoding(context, file_out);
+  if (realtime)
+    deadline_init(&deadline, job->fps, nthreads);
+
+  if (job->throughput > 0) {
+    cores_init(&cores, job->throughput, nthreads);
+    threads = cores.active;
+  }
+
+  codec_init(&codec, context, job->pipelined);
 
   do {
-    frame = de_context_get_next_frame(context, &got_frame);
+    if (frames_done(&frames, frame_index))
+      got_frame = -1;
+    else
+      frame = codec_get_next_frame(&codec, &got_frame);
 
     if (got_frame == -1)
       break;
 
+    if (got_frame && frame && !frames_selected(&frames, frame_index++))
+      continue;
+
     if (got_frame && frame) {
+      int width = frame->width;
+      int height = frame->height;
+
+      /* The controllers of -T and -F keep the share the job started with. */
+      if (job->pool && !realtime && job->throughput <= 0)
+        threads = batch_threads(job->pool, job->slot);
+
+      if (realtime) {
+        deadline_wait(&deadline);
+        threads = deadline.threads;
+
+        if (preview != deadline_preview(&deadline)) {
+          preview = deadline_preview(&deadline);
+          lower = (int) (CANNY_LOWER * preview_threshold_scale(sigma, preview) + 0.5);
+          upper = (int) (CANNY_UPPER * preview_threshold_scale(sigma, preview) + 0.5);
+        }
+      }
+
       start = omp_get_wtime();
-      frame->frame->data[0] = canny_edge_detection(frame->data, frame->width, frame->height,
-                                                   CANNY_LOWER, CANNY_UPPER, CANNY_SIGMA,
-                                                   nthreads);
+
+      if (realtime && deadline_skip(&deadline) && last) {
+        edges = malloc(frame->width * frame->height * sizeof(uint8_t));
+        DIE(edges == NULL, "malloc");
+
+        memcpy(edges, last, frame->width * frame->height * sizeof(uint8_t));
+      } else if (incremental || roi_active(&roi)) {
+        const uint8_t *clean = NULL;
+
+        if (inc && (inc->width != frame->width || inc->height != frame->height)) {
+          incremental_free(inc);
+          inc = NULL;
+        }
+
+        if (inc == NULL) {
+          inc = incremental_create(frame->width, frame->height, sigma, threads);
+          if (roi_active(&roi))
+            incremental_set_roi(inc, &roi);
+        }
+
+        /* -F changes the thread count from frame to frame. */
+        inc->nthreads = threads;
+
+        /* Without -i, the region is detected afresh in every frame. */
+        if (!incremental)
+          incremental_invalidate(inc);
+
+        if (use_motion) {
+          if (motion == NULL)
+            motion = motion_create(frame->width, frame->height);
+
+          if (motion_clean_tiles(motion, frame->frame, INCREMENTAL_TILE, inc->ntx, inc->nty, inc->clean))
+            clean = inc->clean;
+        }
+
+        edges = malloc(frame->width * frame->height * sizeof(uint8_t));
+        DIE(edges == NULL, "malloc");
+
+        memcpy(edges, incremental_canny_edge_detection(inc, frame->data, clean, CANNY_LOWER, CANNY_UPPER),
+               frame->width * frame->height * sizeof(uint8_t));
+      } else if (streaming) {
+        if (stream && (stream->width != frame->width || stream->height != frame->height)) {
+          stream_free(stream);
+          stream = NULL;
+        }
+
+        if (stream == NULL)
+          stream = stream_create(frame->width, frame->height, sigma, CANNY_LOWER, CANNY_UPPER, threads);
+
+        stream->nthreads = threads;
+
+        edges = malloc(frame->width * frame->height * sizeof(uint8_t));
+        DIE(edges == NULL, "malloc");
+
+        stream_frame(stream, frame->data, edges);
+      } else if (preview > 1) {
+        width /= preview;
+        height /= preview;
+
+        small = realloc(small, width * height * sizeof(uint8_t));
+        DIE(small == NULL, "realloc");
+
+        preview_downsample(frame->data, small, frame->width, frame->height, preview, sigma,
+                           0, height, threads);
+
+        if (contours_file)
+          contours_reset(&contours, width, 0, 0, height);
+
+        edges = canny_edge_detection(small, width, height, lower, upper, 0, false,
+                                     threads, contours_file ? &contours : NULL);
+
+        /* The encoder needs full-size frames, the edge map sink does not. */
+        if (edgemap == NULL || realtime) {
+          uint8_t *full = malloc(frame->width * frame->height * sizeof(uint8_t));
+          DIE(full == NULL, "malloc");
+
+          preview_upsample(edges, full, frame->width, frame->height, preview,
+                           0, frame->height, threads);
+          free(edges);
+          edges = full;
+        }
+      } else if (sweep.n > 0) {
+        gradient_t g = canny_gradient(frame->data, frame->width, frame->height,
+                                      sigma, recursive, threads, NULL);
+        pixel_t *nms = canny_non_maximum_suppression(&g, width, height, threads);
+        hysteresis_t *hy = hysteresis_create(width, height);
+
+        for (int i = 0; i < sweep.n; i++) {
+          swept[i] = malloc(width * height * sizeof(uint8_t));
+          DIE(swept[i] == NULL, "malloc");
+
+          hysteresis_classify(hy, nms, sweep.lower[i], sweep.upper[i]);
+          hysteresis_run(hy);
+          hysteresis_output(hy, swept[i]);
+        }
+
+        hysteresis_free(hy);
+        scratch_free(nms);
+        gradient_free(&g);
+      } else if (adaptive >= 0) {
+        unsigned int hist[ADAPTIVE_BINS] = {0};
+        gradient_t g = canny_gradient(frame->data, frame->width, frame->height,
+                                      sigma, recursive, threads, hist);
+
+        adaptive_thresholds(hist, adaptive, CANNY_LOWER, CANNY_UPPER, &lower, &upper);
+
+        if (contours_file)
+          contours_reset(&contours, frame->width, 0, 0, frame->height);
+
+        edges = canny_edges(&g, frame->width, frame->height, lower, upper, threads,
+                            contours_file ? &contours : NULL);
+        gradient_free(&g);
+      } else {
+        if (contours_file)
+          contours_reset(&contours, frame->width, 0, 0, frame->height);
+
+        edges = canny_edge_detection(frame->data, frame->width, frame->height,
+                                     CANNY_LOWER, CANNY_UPPER, sigma, recursive,
+                                     threads, contours_file ? &contours : NULL);
+      }
+
       end = omp_get_wtime();
 
+      /* Whatever its level, a real-time frame goes out at full size. */
+      if (realtime) {
+        width = frame->width;
+        height = frame->height;
+
+        if (!deadline_skip(&deadline)) {
+          last = realloc(last, width * height * sizeof(uint8_t));
+          DIE(last == NULL, "realloc");
+          memcpy(last, edges, width * height * sizeof(uint8_t));
+        }
+      }
+
       time_per_frame = end - start;
-      printf("Time per frame: %lf\n", time_per_frame);
+      printf("%sTime per frame: %lf\n", tag, time_per_frame);
       computational_time += time_per_frame;
 
-      de_context_set_next_frame(context, frame);
+      if (adaptive >= 0)
+        printf("%sThresholds: %d %d\n", tag, lower, upper);
+
+      if (contours_file)
+        contours_write_frame(contours_file, &contours, 1, width, height);
+
+      if (sweep.n > 0) {
+        for (int i = 0; i < sweep.n; i++) {
+          edgemap_write_frame(sweep.maps[i], swept[i], width, height);
+          free(swept[i]);
+        }
+      } else if (edgemap) {
+        edgemap_write_frame(edgemap, edges, width, height);
+        free(edges);
+      } else {
+        frame->frame->data[0] = edges;
+        if (job->gray)
+          codec_neutral_chroma(frame->frame, frame->height);
+        codec_set_next_frame(&codec, frame);
+      }
+
+      if (realtime) {
+        const double late = deadline_done(&deadline);
+
+        if (late > 0)
+          printf("%sDeadline missed by: %lf\n", tag, late);
+      }
+
+      if (job->throughput > 0) {
+        const int next = cores_frame(&cores);
+
+        if (next != threads)
+          printf("%sThreads: %d\n", tag, next);
+        threads = next;
+      }
     }
   } while (1);
 
-  de_context_end_encoding(context);
+  codec_finish(&codec);
+
+  if (sweep.n > 0)
+    sweep_close(&sweep);
+  else if (edgemap)
+    edgemap_close(edgemap);
+  else {
+    #pragma omp critical(libde)
+    CODEC_TIMED(codec.time, de_context_end_encoding(context));
+  }
+
+  if (contours_file) {
+    DIE(fclose(contours_file) != 0, "fclose");
+    contours_free(&contours);
+  }
+
+  if (inc) {
+    printf("%sRecomputed tiles: %.2lf%%\n", tag, 100.0 * inc->tiles_dirty / inc->tiles_total);
+    incremental_free(inc);
+  }
+
+  if (motion)
+    motion_free(motion);
+
+  if (stream)
+    stream_free(stream);
+
+  free(small);
+  free(last);
+
+  if (realtime)
+    deadline_report(&deadline, stdout, tag);
+
+  if (job->throughput > 0) {
+    cores_report(&cores, stdout, tag);
+    cores_free(&cores);
+  }
+
+  scratch_report(stdout);
+  codec_report(&codec, stdout, tag);
+  printf("%sComputational time: %lf\n", tag, computational_time);
+}
+
+/*
+ * Daemon mode: jobs come from clients over a UNIX domain socket and run one
+ * after the other in a worker process, whose OpenMP threads and scratch
+ * buffers stay warm from one job to the next. A job that fails on the way,
+ * through DIE(), takes its worker down but not the daemon, which starts a
+ * fresh one for the next client.
+ *
+ * A request is the client's working directory, then its arguments, as
+ * NUL-terminated strings ended by an empty one. Everything the job prints
+ * goes back to the client, followed by a last "Job status: N" line. The
+ * socket is only open to the daemon's user, since jobs read and write files
+ * as that user.
+ */
+
+#define DAEMON_REQUEST_MAX 8192
+#define DAEMON_ARGS_MAX 64
+
+static void
+daemon_job(const int client, char *argv0, const int nthreads)
+{
+  char request[DAEMON_REQUEST_MAX];
+  char *argv[DAEMON_ARGS_MAX + 1];
+  size_t len = 0;
+  int argc = 0, status = 1;
+  ssize_t n;
+  job_t job;
+  struct ucred peer;
+  socklen_t peer_len = sizeof(peer);
+
+  if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) < 0 || peer.uid != getuid())
+    return;
+
+  /* Read up to the empty string that ends the request. */
+  while (len < 2 || request[len - 1] != '\0' || request[len - 2] != '\0') {
+    n = read(client, request + len, sizeof(request) - len);
+    if (n <= 0 || len + n == sizeof(request))
+      return;
+    len += n;
+  }
+
+  const char *cwd = request;
+  char *arg = request + strlen(cwd) + 1;
+
+  argv[argc++] = argv0;
+  while (*arg && argc < DAEMON_ARGS_MAX) {
+    argv[argc++] = arg;
+    arg += strlen(arg) + 1;
+  }
+  argv[argc] = NULL;
+
+  /* The job writes to the client, from the client's directory. */
+  fflush(stdout);
+  fflush(stderr);
+
+  const int saved_out = dup(STDOUT_FILENO);
+  const int saved_err = dup(STDERR_FILENO);
+  const int saved_cwd = open(".", O_RDONLY | O_DIRECTORY);
+
+  dup2(client, STDOUT_FILENO);
+  dup2(client, STDERR_FILENO);
+
+  if (chdir(cwd) < 0) {
+    printf("Cannot change to %s\n", cwd);
+  } else if (job_parse(&job, argc, argv) == 0) {
+    if (job.cpus || job.huge || job.socket || job.batch || argc - optind < 1 || argc - optind > 2) {
+      print_usage(argv[0]);
+    } else if (access(argv[optind], R_OK) < 0) {
+      printf("Cannot read %s\n", argv[optind]);
+    } else {
+      job.file_in = argv[optind];
+      job.file_out = argc - optind == 2 ? argv[optind + 1] : "out.mpg";
+
+      job_run(&job, nthreads);
+      status = 0;
+    }
+  }
+
+  printf("Job status: %d\n", status);
+  fflush(stdout);
+  fflush(stderr);
+
+  DIE(fchdir(saved_cwd) < 0, "fchdir");
+  dup2(saved_out, STDOUT_FILENO);
+  dup2(saved_err, STDERR_FILENO);
+  close(saved_out);
+  close(saved_err);
+  close(saved_cwd);
+}
+
+/*
+ * Serve jobs in a worker process, pinned like the team of a plain run.
+ */
+static void
+daemon_serve(const int listener, char *argv0, const int nthreads, const affinity_t *affinity)
+{
+  int client;
+
+  /* Go with the daemon, rather than hold its socket. */
+  DIE(prctl(PR_SET_PDEATHSIG, SIGTERM) < 0, "prctl");
+
+  if (affinity->n > 0) {
+    #pragma omp parallel num_threads(nthreads)
+    affinity_pin(affinity, omp_get_thread_num());
+  }
+
+  while (1) {
+    client = accept(listener, NULL, NULL);
+    if (client < 0)
+      continue;
+
+    daemon_job(client, argv0, nthreads);
+    close(client);
+  }
+}
+
+static void
+daemon_run(const char *path, char *argv0, const int nthreads, const affinity_t *affinity)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct stat st;
+  mode_t mask;
+  pid_t worker;
+  int listener, probe, status;
+
+  DIE(strlen(path) >= sizeof(addr.sun_path), "socket path too long");
+  strcpy(addr.sun_path, path);
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  DIE(listener < 0, "socket");
+
+  /* Only replace the socket of a daemon that is gone. */
+  if (lstat(path, &st) == 0) {
+    errno = ENOTSOCK;
+    DIE(!S_ISSOCK(st.st_mode), path);
+
+    probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    DIE(probe < 0, "socket");
+    errno = EADDRINUSE;
+    DIE(connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0, path);
+    close(probe);
+
+    DIE(unlink(path) < 0, "unlink");
+  }
+
+  mask = umask(0177);
+  DIE(bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0, "bind");
+  umask(mask);
+  DIE(listen(listener, SOMAXCONN) < 0, "listen");
+
+  /* A client hanging up must not take the daemon down. */
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("Listening on %s with %d threads\n", path, nthreads);
+  fflush(stdout);
+
+  /* No OpenMP threads here: the workers start their own after the fork. */
+  while (1) {
+    worker = fork();
+    DIE(worker < 0, "fork");
+
+    if (worker == 0)
+      daemon_serve(listener, argv0, nthreads, affinity);
+
+    DIE(waitpid(worker, &status, 0) < 0, "waitpid");
+
+    printf("Worker exited with status %d, starting a new one\n",
+           WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    fflush(stdout);
+  }
+}
+
+/*
+ * Batch mode: the inputs share one pool of nthreads threads instead of one
+ * process each. Up to nthreads videos are open at once, each worked on by its
+ * share of the threads (see batch_threads()), and a slot that finishes its
+ * video takes the next input, so short or decode-bound clips do not leave
+ * cores idle. A video only ever has one frame in flight, so its frames go out
+ * in order.
+ *
+ * Every input is encoded to the output directory under its own name; with
+ * -e EXT, its edge map goes there instead, with EXT appended.
+ */
+static void
+batch_run(const job_t *job, const int nthreads, char **inputs, const int ninputs)
+{
+  const int slots = ninputs < nthreads ? ninputs : nthreads;
+  batch_t pool = {nthreads, slots, NULL};
+  int next = 0;
+
+  pool.running = calloc(slots, sizeof(int));
+  DIE(pool.running == NULL, "calloc");
+
+  /* Slots running more than one thread open nested regions. */
+  omp_set_max_active_levels(2);
+
+  #pragma omp parallel num_threads(slots)
+  {
+    char file_out[PATH_MAX], file_edges[PATH_MAX];
+    job_t mine = *job;
+    const int slot = omp_get_thread_num();
+    int i;
+
+    mine.pool = &pool;
+    mine.slot = slot;
+
+    while (1) {
+      #pragma omp atomic capture
+      i = next++;
+
+      if (i >= ninputs)
+        break;
+
+      const char *name = strrchr(inputs[i], '/') ? strrchr(inputs[i], '/') + 1 : inputs[i];
+
+      snprintf(file_out, sizeof(file_out), "%s/%s", job->batch, name);
+      mine.file_in = inputs[i];
+      mine.file_out = file_out;
+      mine.name = name;
+
+      if (job->file_edges) {
+        snprintf(file_edges, sizeof(file_edges), "%s/%s.%s", job->batch, name, job->file_edges);
+        mine.file_edges = file_edges;
+      }
+
+      if (strcmp(mine.file_out, mine.file_in) == 0) {
+        fprintf(stderr, "Skipping %s, which would be its own output\n", inputs[i]);
+        continue;
+      }
+
+      #pragma omp atomic write
+      pool.running[slot] = 1;
+
+      job_run(&mine, batch_threads(&pool, slot));
+
+      #pragma omp atomic write
+      pool.running[slot] = 0;
+    }
+  }
+
+  free(pool.running);
+}
+
+int main(int argc, char **argv)
+{
+  affinity_t affinity = {0};
+  job_t job;
+  int nthreads;
+
+  if (job_parse(&job, argc, argv) < 0)
+    exit(1);
+
+  if (job.cpus && affinity_parse(&affinity, job.cpus) < 0) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  scratch_stats.huge = job.huge;
+
+  /*
+   * The team's static row blocks are the same every frame, so reused buffers
+   * keep every row on the node of the thread that works on it.
+   */
+  scratch_cache_enable();
+
+  /*
+   * A daemon only takes the number of threads, the videos come from
+   * clients; a batch takes it first, then any number of inputs.
+   */
+  if (job.socket ? argc - optind != 1 :
+      job.batch ? argc - optind < 2 :
+      argc - optind < 2 || argc - optind > 3) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  if (job.socket || job.batch) {
+    nthreads = atoi(argv[optind]);
+  } else {
+    job.file_in = argv[optind];
+    nthreads = atoi(argv[optind + 1]);
+    job.file_out = argc - optind == 3 ? argv[optind + 2] : "out.mpg";
+  }
+
+  /*
+   * Pin the team once; later parallel regions of the same size reuse its
+   * threads, each with the same omp_get_thread_num(). A daemon's workers pin
+   * their own.
+   */
+  if (affinity.n > 0 && !job.socket) {
+    #pragma omp parallel num_threads(nthreads)
+    affinity_pin(&affinity, omp_get_thread_num());
+  }
 
-  printf("Computational time: %lf\n", computational_time);
+  if (job.socket)
+    daemon_run(job.socket, argv[0], nthreads, &affinity);
+  else if (job.batch)
+    batch_run(&job, nthreads, argv + optind + 1, argc - optind - 1);
+  else
+    job_run(&job, nthreads);
 
   return 0;
 }
@@ -1,11 +1,25 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "../libde/de.h"
+#include "affinity.h"
+#include "codec.h"
+#include "contours.h"
+#include "cores.h"
+#include "edgemap.h"
+#include "frames.h"
+#include "hysteresis.h"
+#include "iir.h"
+#include "kernels.h"
+#include "preview.h"
+#include "scratch.h"
 #include "utils.h"
 
 #define MAX_BRIGHTNESS 255
@@ -21,13 +35,29 @@ typedef struct {
   int id;
   int offset;
   int my_height;
+  int rows;                 // copied back into the frame
 } thread_arg_t;
 
 /* Global shared variables. */
 DeContext *context = NULL;
 DeFrame *frame = NULL;
+contours_t *contours = NULL;
 int chunk_height;
 
+/* Fast preview: the threads work on the frame downscaled by this factor. */
+int preview = 1;
+int width, height;
+int lower = CANNY_LOWER;
+int upper = CANNY_UPPER;
+uint8_t *small_edges = NULL;
+
+/* Gaussian blur settings. */
+float sigma = CANNY_SIGMA;
+bool recursive = false;
+
+/* Thread placement, if any. */
+affinity_t affinity;
+
 /*
  * If normalize is true, then map pixels to range 0 -> MAX_BRIGHTNESS.
  */
@@ -41,29 +71,36 @@ convolution(const pixel_t *in,
             const bool     normalize)
 {
   const int khalf = kn / 2;
-  float min = 0.5;
-  float max = 254.5;
-  float pixel = 0.0;
-  size_t c = 0;
-  int m, n, i, j;
+  const kernel_convolve_t convolve = kernel_convolve(kn);
 
   assert(kn % 2 == 1);
   assert(nx > kn && ny > kn);
 
-  for (m = khalf; m < nx - khalf; m++) {
-    for (n = khalf; n < ny - khalf; n++) {
-      pixel = c = 0;
+  convolve(in + khalf * nx + khalf, nx, out + khalf * nx + khalf, nx, kernel, kn,
+           nx - 2 * khalf, ny - 2 * khalf, normalize);
+}
 
-      for (j = -khalf; j <= khalf; j++)
-        for (i = -khalf; i <= khalf; i++)
-          pixel += in[(n - j) * nx + m - i] * kernel[c++];
+/*
+ * Convolution of the 8-bit luma, mapped to range 0 -> MAX_BRIGHTNESS like
+ * convolution() with normalize set. Reading the frame as it is saves
+ * widening it to pixel_t first.
+ */
+static void
+convolution_u8(const uint8_t *in,
+               pixel_t       *out,
+               const float   *kernel,
+               const int      nx,
+               const int      ny,
+               const int      kn)
+{
+  const int khalf = kn / 2;
+  const kernel_convolve_u8_t convolve = kernel_convolve_u8(kn);
 
-      if (normalize == true)
-        pixel = MAX_BRIGHTNESS * (pixel - min) / (max - min);
+  assert(kn % 2 == 1);
+  assert(nx > kn && ny > kn);
 
-      out[n * nx + m] = (pixel_t) pixel;
-    }
-  }
+  convolve(in + khalf * nx + khalf, nx, out + khalf * nx + khalf, nx, kernel, kn,
+           nx - 2 * khalf, ny - 2 * khalf, true);
 }
 
 /*
@@ -76,14 +113,23 @@ convolution(const pixel_t *in,
  * 2.0 <= sigma < 2.5 : 11
  * 2.5 <= sigma < 3.0 : 13 ...
  * kernel size = 2 * int(2 * sigma) + 3;
+ *
+ * If recursive is true, the recursive filter from iir.h is used instead,
+ * whose cost does not depend on sigma.
  */
 static void
-gaussian_filter(const pixel_t *in,
+gaussian_filter(const uint8_t *in,
                 pixel_t       *out,
                 const int      nx,
                 const int      ny,
-                const float    sigma)
+                const float    sigma,
+                const bool     recursive)
 {
+  if (recursive) {
+    iir_gaussian(in, out, nx, ny, sigma, 1);
+    return;
+  }
+
   const int n = 2 * (int) (2 * sigma) + 3;
   const float mean = (float) floor(n / 2.0);
   float kernel[n * n];
@@ -95,7 +141,33 @@ gaussian_filter(const pixel_t *in,
       kernel[c++] = exp(-0.5 * (pow((i - mean) / sigma, 2.0) + pow((j - mean) / sigma, 2.0))) / (2 * M_PI * sigma * sigma);
   }
 
-  convolution(in, out, kernel, nx, ny, n, true);
+  convolution_u8(in, out, kernel, nx, ny, n);
+}
+
+/*
+ * Whether pixel c is a local maximum of G along its gradient direction.
+ */
+static inline bool
+canny_is_maximum(const pixel_t *G,
+                 const pixel_t *after_Gx,
+                 const pixel_t *after_Gy,
+                 const int      c,
+                 const int      width)
+{
+  const int nn = c - width;
+  const int ss = c + width;
+  const int ww = c + 1;
+  const int ee = c - 1;
+  const int nw = nn + 1;
+  const int ne = nn - 1;
+  const int sw = ss + 1;
+  const int se = ss - 1;
+  const float dir = (float) (fmod(atan2(after_Gy[c], after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
+
+  return ((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
+         ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
+         ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
+         ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]);   // 135 deg
 }
 
 /*
@@ -106,6 +178,15 @@ gaussian_filter(const pixel_t *in,
  * http://www.songho.ca/dsp/cannyedge/cannyedge.html
  *
  * Note: T1 and T2 are lower and upper thresholds.
+ *
+ * If contours is not NULL, every traced edge is also recorded as a contour,
+ * so edges are traced one at a time; otherwise non-maximum suppression
+ * classifies the pixels straight into the bit planes of hysteresis.h.
+ * A sigma of 0 skips the blur, for input that is already smoothed.
+ *
+ * Strong pixels only start an edge up to linear index seed_limit, which is
+ * where the limit of hysteresis.h falls for the whole frame, so that the
+ * last strip ends like the frame does.
  */
 
 static uint8_t *
@@ -114,7 +195,10 @@ canny_edge_detection(const uint8_t *in,
                      const int      height,
                      const int      t1,
                      const int      t2,
-                     const float    sigma)
+                     const float    sigma,
+                     const bool     recursive,
+                     const size_t   seed_limit,
+                     contours_t    *contours)
 {
   int i, j, k, nedges;
   int *edges;
@@ -124,30 +208,17 @@ canny_edge_detection(const uint8_t *in,
   const float Gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
   const float Gy[] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
 
-  pixel_t *G = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(G == NULL, "calloc");
-
-  pixel_t *after_Gx = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(after_Gx == NULL, "calloc");
-
-  pixel_t *after_Gy = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(after_Gy == NULL, "calloc");
-
-  pixel_t *nms = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(nms == NULL, "calloc");
-
-  pixel_t *out = malloc(width * height * sizeof(pixel_t));
-  DIE(out == NULL, "malloc");
+  /* Fresh pages, first touched by this thread. */
+  pixel_t *G = scratch_alloc(height, width * sizeof(pixel_t), 1);
+  pixel_t *after_Gx = scratch_alloc(height, width * sizeof(pixel_t), 1);
+  pixel_t *after_Gy = scratch_alloc(height, width * sizeof(pixel_t), 1);
+  pixel_t *out = scratch_alloc(height, width * sizeof(pixel_t), 1);
 
-  pixel_t *pixels = malloc(width * height * sizeof(pixel_t));
-  DIE(pixels == NULL, "malloc");
-
-  /* Convert to pixel_t. */
-  for (i = 0; i < width * height; i++) {
-    pixels[i] = (pixel_t)in[i];
-  }
-
-  gaussian_filter(pixels, out, width, height, sigma);
+  if (sigma > 0)
+    gaussian_filter(in, out, width, height, sigma, recursive);
+  else
+    for (i = 0; i < width * height; i++)
+      out[i] = (pixel_t)in[i];
 
   convolution(out, after_Gx, Gx, width, height, 3, false);
 
@@ -160,48 +231,67 @@ canny_edge_detection(const uint8_t *in,
     }
   }
 
+  retval = calloc(width * height * sizeof(uint8_t), 1);
+  DIE(retval == NULL, "calloc");
+
+  if (contours == NULL) {
+    hysteresis_t *hy = hysteresis_create(width, height);
+
+    if (seed_limit < hy->seed_limit)
+      hy->seed_limit = seed_limit;
+
+    /* Pixels below T1 are discarded before the direction is computed. */
+    for (j = 1; j < height - 1; j++) {
+      for (i = 1; i < width - 1; i++) {
+        const int c = i + width * j;
+        const pixel_t nms = G[c] >= t1 && canny_is_maximum(G, after_Gx, after_Gy, c, width) ? G[c] : 0;
+
+        hysteresis_mark(hy, i, j, nms, t1, t2);
+      }
+    }
+
+    hysteresis_run(hy);
+    hysteresis_output(hy, retval);
+    hysteresis_free(hy);
+
+    scratch_free(after_Gx);
+    scratch_free(after_Gy);
+    scratch_free(G);
+    scratch_free(out);
+
+    return retval;
+  }
+
+  pixel_t *nms = scratch_alloc(height, width * sizeof(pixel_t), 1);
+
   /* Non-maximum suppression, straightforward implementation. */
   for (i = 1; i < width - 1; i++) {
     for (j = 1; j < height - 1; j++) {
       const int c = i + width * j;
-      const int nn = c - width;
-      const int ss = c + width;
-      const int ww = c + 1;
-      const int ee = c - 1;
-      const int nw = nn + 1;
-      const int ne = nn - 1;
-      const int sw = ss + 1;
-      const int se = ss - 1;
-      const float dir = (float) (fmod(atan2(after_Gy[c], after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
-
-      if (((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
-          ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
-          ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
-          ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]))   // 135 deg
-        nms[c] = G[c];
-      else
-        nms[c] = 0;
+      nms[c] = canny_is_maximum(G, after_Gx, after_Gy, c, width) ? G[c] : 0;
     }
   }
 
-  /* Reuse the array used as a stack, width * height / 2 elements should be enough. */
-  edges = (int *) after_Gy;
-  memset(out, 0, sizeof(pixel_t) * width * height);
-  memset(edges, 0, sizeof(pixel_t) * width * height);
+  /* Used as a stack; a pixel is pushed at most once. */
+  edges = scratch_alloc(height, width * sizeof(int), 1);
 
   /* Tracing edges with hysteresis. Non-recursive implementation. */
   for (j = 1; j < height - 1; j++) {
     for (i = 1; i < width - 1; i++) {
       /* Trace edges. */
-      if (nms[t] >= t2 && out[t] == 0) {
-        out[t] = MAX_BRIGHTNESS;
+      if (t <= seed_limit && nms[t] >= t2 && retval[t] == 0) {
+        retval[t] = MAX_BRIGHTNESS;
         nedges = 1;
         edges[0] = t;
 
+        contours_begin(contours);
+
         do {
           nedges--;
           const int e = edges[nedges];
 
+          contours_add(contours, e);
+
           int nbs[8]; // neighbours
           nbs[0] = e - width;     // nn
           nbs[1] = e + width;     // ss
@@ -213,8 +303,9 @@ canny_edge_detection(const uint8_t *in,
           nbs[7] = nbs[1] - 1; // se
 
           for (k = 0; k < 8; k++) {
-            if (nms[nbs[k]] >= t1 && out[nbs[k]] == 0) {
-              out[nbs[k]] = MAX_BRIGHTNESS;
+            if (hysteresis_interior(nbs[k], width, height) &&
+                nms[nbs[k]] >= t1 && retval[nbs[k]] == 0) {
+              retval[nbs[k]] = MAX_BRIGHTNESS;
               edges[nedges] = nbs[k];
               nedges++;
             }
@@ -225,20 +316,12 @@ canny_edge_detection(const uint8_t *in,
     }
   }
 
-  retval = malloc(width * height * sizeof(uint8_t));
-  DIE(retval == NULL, "malloc");
-
-  /* Convert back to uint8_t */
-  for (i = 0; i < width * height; i++) {
-    retval[i] = (uint8_t)out[i];
-  }
-
-  free(after_Gx);
-  free(after_Gy);
-  free(G);
-  free(nms);
-  free(pixels);
-  free(out);
+  scratch_free(after_Gx);
+  scratch_free(after_Gy);
+  scratch_free(G);
+  scratch_free(nms);
+  scratch_free(out);
+  scratch_free(edges);
 
   return retval;
 }
@@ -247,117 +330,360 @@ static void *
 thread_function(void *thread_arg)
 {
   thread_arg_t *arg;
-  uint8_t *block;
+  uint8_t *block, *small = NULL;
+  uint8_t *dst = preview > 1 ? small_edges : frame->frame->data[0];
+  size_t seed_limit;
 
   arg = (thread_arg_t *) thread_arg;
+  seed_limit = (size_t) (width - 2) * (height - 2) - arg->offset;
+
+  /* Pinned before allocating, so that the strip's buffers are local. */
+  if (affinity.n > 0)
+    affinity_pin(&affinity, arg->id);
 
-  block = canny_edge_detection(frame->data + arg->offset,
-                               frame->width, arg->my_height,
-                               CANNY_LOWER, CANNY_UPPER, CANNY_SIGMA);
+  /* Only record the rows this thread copies back into the frame. */
+  if (contours) {
+    contours_reset(&contours[arg->id], width, arg->offset / width,
+                   arg->id == 0 ? 0 : CORRECTION,
+                   (arg->id == 0 ? 0 : CORRECTION) + arg->rows);
+  }
+
+  if (preview > 1) {
+    /* Downscale the strip, overlap included, into a private buffer. */
+    small = malloc(width * arg->my_height * sizeof(uint8_t));
+    DIE(small == NULL, "malloc");
+
+    preview_downsample(frame->data, small, frame->width, frame->height, preview, sigma,
+                       arg->offset / width, arg->offset / width + arg->my_height, 1);
+
+    block = canny_edge_detection(small, width, arg->my_height, lower, upper, 0, false,
+                                 seed_limit, contours ? &contours[arg->id] : NULL);
+  } else {
+    block = canny_edge_detection(frame->data + arg->offset,
+                                 width, arg->my_height,
+                                 CANNY_LOWER, CANNY_UPPER, sigma, recursive,
+                                 seed_limit, contours ? &contours[arg->id] : NULL);
+  }
 
   if (arg->id == 0) {
-    memcpy(frame->frame->data[0], block, frame->width * chunk_height);
+    memcpy(dst, block, width * arg->rows);
   } else {
-    memcpy(frame->frame->data[0] + (arg->id * frame->width * chunk_height),
-           block + frame->width * CORRECTION,
-           frame->width * chunk_height);
+    memcpy(dst + (arg->id * width * chunk_height),
+           block + width * CORRECTION,
+           width * arg->rows);
   }
 
   free(block);
+  free(small);
 
   return NULL;
 }
 
+/*
+ * Divide the frame into n strips of chunk_height rows, the last one taking
+ * the rows left over as well. Every strip also covers the CORRECTION rows of
+ * each neighbour it has, so that the blur and the Sobel operator see the
+ * same pixels as on the whole frame; a single strip has no neighbour and
+ * covers the frame exactly.
+ */
+static void
+divide_strips(thread_arg_t *args, const int n, const int width, const int height)
+{
+  const int chunk_start = chunk_height * width;
+  const int last_rows = height - (n - 1) * chunk_height;
+  int i;
+
+  /* Divide the work to the first thread. */
+  args[0].id = 0;
+  args[0].offset = 0;
+  args[0].rows = n > 1 ? chunk_height : height;
+  args[0].my_height = args[0].rows + (n > 1 ? CORRECTION : 0);
+
+  if (n == 1)
+    return;
+
+  /* Divide the work to the last thread. */
+  args[n - 1].id = n - 1;
+  args[n - 1].offset = (n - 1) * chunk_start - CORRECTION * width;
+  args[n - 1].rows = last_rows;
+  args[n - 1].my_height = last_rows + CORRECTION;
+
+  /* Divide the work to the remaining threads. */
+  for (i = 1; i < n - 1; i++) {
+    args[i].id = i;
+    args[i].offset = i * chunk_start - CORRECTION * width;
+    args[i].rows = chunk_height;
+    args[i].my_height = chunk_height + CORRECTION * 2;
+  }
+}
+
 static void
 print_usage(const char *argv0)
 {
-  fprintf(stderr, "Usage: %s <IN.mpg> <NUM> [OUT.mpg]\n", argv0);
+  fprintf(stderr, "Usage: %s [-e EDGES] [-c MODE] [-o CONTOURS] [-p FACTOR] [-s SIGMA] [-r] [-g] [-P] [-f RANGE] [-F FPS] [-b CPUS] [-H] <IN.mpg> <NUM> [OUT.mpg]\n", argv0);
   fprintf(stderr, "Required arguments:\n"
                   "  <IN.mpg>\tthe input video file\n"
                   "  <NUM>\t\tthe number of threads\n"
                   "Optional arguments:\n"
-                  "  [OUT.mpg]\tthe output video file\n");
+                  "  [OUT.mpg]\tthe output video file\n"
+                  "  -e EDGES\twrite bit-packed edge maps to EDGES instead of encoding\n"
+                  "  -c MODE\tedge map compression: none, rle or delta (default: rle)\n"
+                  "  -o CONTOURS\twrite the traced edge contours to CONTOURS\n"
+                  "  -p FACTOR\tfast preview: detect edges on the frame downscaled by 2 or 4\n"
+                  "  -s SIGMA\tGaussian blur sigma, at least 0.5 (default: 1.0)\n"
+                  "  -r\t\tuse a recursive Gaussian, whose cost does not depend on sigma\n"
+                  "  -g\t\tencode the edges with constant neutral chroma, cheaper to encode\n"
+                  "  -P\t\tdecode and encode on a codec thread, alongside edge detection\n"
+                  "  -f RANGE\tonly process the frames START:END[:STRIDE], counted from 0,\n"
+                  "    \t\tand stop decoding at END\n"
+                  "  -F FPS\tuse as few of the NUM threads as keep up with FPS frames\n"
+                  "    \t\tper second\n"
+                  "  -b CPUS\tpin the threads: compact, scatter or a CPU list like 0-7,16-23\n"
+                  "  -H\t\tback the frame buffers with 2 MB huge pages where possible\n");
 }
 
 int main(int argc, char **argv)
 {
   const char *file_in;
   const char *file_out;
+  const char *file_edges = NULL;
+  const char *file_contours = NULL;
 
+  edgemap_t *edgemap = NULL;
+  FILE *contours_file = NULL;
+  frames_t frames = FRAMES_ALL;
+  long frame_index = 0;
   int got_frame = 0;
-  int i, ret, nthreads, chunk_start;
+  int compression = EDGEMAP_RLE;
+  bool gray = false;
+  bool pipelined = false;
+  codec_t codec;
+  double throughput = 0;
+  cores_t cores;
+  int i, ret, opt, nthreads, active;
 
   struct timespec start, end;
   double time_per_frame, computational_time = 0;
 
-  if (argc < 3 || argc > 4) {
+  while ((opt = getopt(argc, argv, "e:c:o:p:s:rgPf:F:b:H")) != -1) {
+    switch (opt) {
+    case 'e':
+      file_edges = optarg;
+      break;
+    case 'c':
+      compression = edgemap_parse_compression(optarg);
+      if (compression < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'o':
+      file_contours = optarg;
+      break;
+    case 'p':
+      preview = atoi(optarg);
+      if (preview != 2 && preview != 4) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 's':
+      sigma = atof(optarg);
+      if (sigma < 0.5) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'r':
+      recursive = true;
+      break;
+    case 'g':
+      gray = true;
+      break;
+    case 'P':
+      pipelined = true;
+      break;
+    case 'f':
+      if (frames_parse(&frames, optarg) < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'F':
+      throughput = atof(optarg);
+      if (throughput <= 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'b':
+      if (affinity_parse(&affinity, optarg) < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'H':
+      scratch_stats.huge = true;
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (argc - optind < 2 || argc - optind > 3) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  /*
+   * Reuse the strips' buffers from frame to frame, unless pinned: a pinned
+   * worker has to first touch its own, and a reused one may come from
+   * another worker's strip.
+   */
+  if (affinity.n == 0)
+    scratch_cache_enable();
+
+  /* The preview blurs with a kernel. */
+  if (recursive && preview > 1) {
     print_usage(argv[0]);
     exit(1);
   }
 
-  file_in = argv[1];
-  nthreads = atoi(argv[2]);
-  file_out = argc == 4 ? argv[3] : "out.mpg";
+  if (preview > 1) {
+    const float scale = preview_threshold_scale(sigma, preview);
+
+    lower = (int) (CANNY_LOWER * scale + 0.5);
+    upper = (int) (CANNY_UPPER * scale + 0.5);
+  }
+
+  file_in = argv[optind];
+  nthreads = atoi(argv[optind + 1]);
+  file_out = argc - optind == 3 ? argv[optind + 2] : "out.mpg";
 
   thread_arg_t args[nthreads];
   pthread_t threads[nthreads];
 
   context = de_context_create(file_in);
-  de_context_prepare_encoding(context, file_out);
+
+  /* The edge map sink replaces the encoder entirely. */
+  if (file_edges)
+    edgemap = edgemap_create(file_edges, compression);
+  else
+    de_context_prepare_encoding(context, file_out);
+
+  if (file_contours) {
+    contours_file = contours_create(file_contours);
+
+    contours = calloc(nthreads, sizeof(contours_t));
+    DIE(contours == NULL, "calloc");
+  }
+
+  /* With -F, only the first active threads are started for a frame. */
+  active = nthreads;
+  if (throughput > 0) {
+    cores_init(&cores, throughput, nthreads);
+    active = cores.active;
+  }
+
+  codec_init(&codec, context, pipelined);
 
   do {
-    frame = de_context_get_next_frame(context, &got_frame);
+    if (frames_done(&frames, frame_index))
+      got_frame = -1;
+    else
+      frame = codec_get_next_frame(&codec, &got_frame);
 
     if (got_frame == -1)
       break;
 
+    if (got_frame && frame && !frames_selected(&frames, frame_index++))
+      continue;
+
     if (got_frame && frame) {
       DIE(clock_gettime(CLOCK_MONOTONIC, &start) == -1, "clock_gettime");
 
-      chunk_height = frame->height / nthreads;
-      chunk_start = (chunk_height - CORRECTION) * frame->width;
-
-      /* Divide the work to the first thread. */
-      args[0].id = 0;
-      args[0].offset = 0;
-      args[0].my_height = chunk_height + CORRECTION;
+      width = frame->width / preview;
+      height = frame->height / preview;
 
-      /* Divide the work to the last thread. */
-      args[nthreads - 1].id = nthreads - 1;
-      args[nthreads - 1].offset = (nthreads - 1) * chunk_start;
-      args[nthreads - 1].my_height = chunk_height + CORRECTION;
+      chunk_height = height / active;
 
-      /* Divide the work to the remaining threads. */
-      for (i = 1; i < nthreads - 1; i++) {
-        args[i].id = i;
-        args[i].offset = i * chunk_start;
-        args[i].my_height = chunk_height + CORRECTION * 2;
+      if (preview > 1) {
+        small_edges = calloc(width * height, sizeof(uint8_t));
+        DIE(small_edges == NULL, "calloc");
       }
 
+      divide_strips(args, active, width, height);
+
       /* Launch the threads. */
-      for (i = 0; i < nthreads; i++) {
+      for (i = 0; i < active; i++) {
         ret = pthread_create(&threads[i], NULL, &thread_function, &args[i]);
         DIE(ret != 0, "pthread_create");
       }
 
       /* Wait for all the threads to complete execution. */
-      for (i = 0; i < nthreads; i++) {
+      for (i = 0; i < active; i++) {
         ret = pthread_join(threads[i], NULL);
         DIE(ret != 0, "pthread_join");
       }
 
+      /* The encoder needs full-size frames, the edge map sink does not. */
+      if (preview > 1 && edgemap == NULL)
+        preview_upsample(small_edges, frame->frame->data[0], frame->width, frame->height, preview,
+                         0, frame->height, 1);
+
       DIE(clock_gettime(CLOCK_MONOTONIC, &end) == -1, "clock_gettime");
 
       time_per_frame = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
       printf("Time per frame: %lf\n", time_per_frame);
       computational_time += time_per_frame;
 
-      de_context_set_next_frame(context, frame);
+      if (contours_file)
+        contours_write_frame(contours_file, contours, active, width, height);
+
+      if (edgemap)
+        edgemap_write_frame(edgemap, preview > 1 ? small_edges : frame->frame->data[0], width, height);
+      else {
+        if (gray)
+          codec_neutral_chroma(frame->frame, frame->height);
+        codec_set_next_frame(&codec, frame);
+      }
+
+      free(small_edges);
+      small_edges = NULL;
+
+      if (throughput > 0) {
+        const int next = cores_frame(&cores);
+
+        if (next != active)
+          printf("Threads: %d\n", next);
+        active = next;
+      }
     }
   } while (1);
 
-  de_context_end_encoding(context);
+  codec_finish(&codec);
+
+  if (edgemap)
+    edgemap_close(edgemap);
+  else
+    CODEC_TIMED(codec.time, de_context_end_encoding(context));
+
+  if (contours_file) {
+    DIE(fclose(contours_file) != 0, "fclose");
+
+    for (i = 0; i < nthreads; i++)
+      contours_free(&contours[i]);
+    free(contours);
+  }
+
+  if (throughput > 0) {
+    cores_report(&cores, stdout, "");
+    cores_free(&cores);
+  }
 
+  scratch_report(stdout);
+  codec_report(&codec, stdout, "");
   printf("Computational time: %lf\n", computational_time);
 
   return 0;
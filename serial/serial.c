@@ -3,8 +3,23 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "../libde/de.h"
+#include "adaptive.h"
+#include "codec.h"
+#include "contours.h"
+#include "edgemap.h"
+#include "frames.h"
+#include "hysteresis.h"
+#include "iir.h"
+#include "incremental.h"
+#include "kernels.h"
+#include "motion.h"
+#include "preview.h"
+#include "roi.h"
+#include "stream.h"
+#include "sweep.h"
 #include "utils.h"
 
 #define MAX_BRIGHTNESS 255
@@ -28,29 +43,36 @@ convolution(const pixel_t *in,
             const bool     normalize)
 {
   const int khalf = kn / 2;
-  float min = 0.5;
-  float max = 254.5;
-  float pixel = 0.0;
-  size_t c = 0;
-  int m, n, i, j;
+  const kernel_convolve_t convolve = kernel_convolve(kn);
 
   assert(kn % 2 == 1);
   assert(nx > kn && ny > kn);
 
-  for (m = khalf; m < nx - khalf; m++) {
-    for (n = khalf; n < ny - khalf; n++) {
-      pixel = c = 0;
+  convolve(in + khalf * nx + khalf, nx, out + khalf * nx + khalf, nx, kernel, kn,
+           nx - 2 * khalf, ny - 2 * khalf, normalize);
+}
 
-      for (j = -khalf; j <= khalf; j++)
-        for (i = -khalf; i <= khalf; i++)
-          pixel += in[(n - j) * nx + m - i] * kernel[c++];
+/*
+ * Convolution of the 8-bit luma, mapped to range 0 -> MAX_BRIGHTNESS like
+ * convolution() with normalize set. Reading the frame as it is saves
+ * widening it to pixel_t first.
+ */
+static void
+convolution_u8(const uint8_t *in,
+               pixel_t       *out,
+               const float   *kernel,
+               const int      nx,
+               const int      ny,
+               const int      kn)
+{
+  const int khalf = kn / 2;
+  const kernel_convolve_u8_t convolve = kernel_convolve_u8(kn);
 
-      if (normalize == true)
-        pixel = MAX_BRIGHTNESS * (pixel - min) / (max - min);
+  assert(kn % 2 == 1);
+  assert(nx > kn && ny > kn);
 
-      out[n * nx + m] = (pixel_t) pixel;
-    }
-  }
+  convolve(in + khalf * nx + khalf, nx, out + khalf * nx + khalf, nx, kernel, kn,
+           nx - 2 * khalf, ny - 2 * khalf, true);
 }
 
 /*
@@ -63,14 +85,23 @@ convolution(const pixel_t *in,
  * 2.0 <= sigma < 2.5 : 11
  * 2.5 <= sigma < 3.0 : 13 ...
  * kernel size = 2 * int(2 * sigma) + 3;
+ *
+ * If recursive is true, the recursive filter from iir.h is used instead,
+ * whose cost does not depend on sigma.
  */
 static void
-gaussian_filter(const pixel_t *in,
+gaussian_filter(const uint8_t *in,
                 pixel_t       *out,
                 const int      nx,
                 const int      ny,
-                const float    sigma)
+                const float    sigma,
+                const bool     recursive)
 {
+  if (recursive) {
+    iir_gaussian(in, out, nx, ny, sigma, 1);
+    return;
+  }
+
   const int n = 2 * (int) (2 * sigma) + 3;
   const float mean = (float) floor(n / 2.0);
   float kernel[n * n];
@@ -82,7 +113,7 @@ gaussian_filter(const pixel_t *in,
       kernel[c++] = exp(-0.5 * (pow((i - mean) / sigma, 2.0) + pow((j - mean) / sigma, 2.0))) / (2 * M_PI * sigma * sigma);
   }
 
-  convolution(in, out, kernel, nx, ny, n, true);
+  convolution_u8(in, out, kernel, nx, ny, n);
 }
 
 /*
@@ -92,91 +123,181 @@ gaussian_filter(const pixel_t *in,
  * http://fourier.eng.hmc.edu/e161/lectures/canny/node1.html
  * http://www.songho.ca/dsp/cannyedge/cannyedge.html
  *
- * Note: T1 and T2 are lower and upper thresholds.
+ * The first stage (blur, Sobel and gradient magnitude) does not depend on the
+ * thresholds; the second thins the gradient with non-maximum suppression and
+ * traces edges with hysteresis, so that several threshold pairs can share one
+ * first stage.
  */
 
-static uint8_t *
-canny_edge_detection(const uint8_t *in,
-                     const int      width,
-                     const int      height,
-                     const int      t1,
-                     const int      t2,
-                     const float    sigma)
+typedef struct {
+  pixel_t *G;
+  pixel_t *after_Gx;
+  pixel_t *after_Gy;
+} gradient_t;
+
+/*
+ * A sigma of 0 skips the blur, for input that is already smoothed. If hist is
+ * not NULL, the gradient magnitudes are also counted into its ADAPTIVE_BINS
+ * bins.
+ */
+static gradient_t
+canny_gradient(const uint8_t *in,
+               const int      width,
+               const int      height,
+               const float    sigma,
+               const bool     recursive,
+               unsigned int  *hist)
 {
-  int i, j, k, nedges;
-  int *edges;
-  size_t t = 1;
-  uint8_t *retval;
+  gradient_t g;
+  int i, j;
 
   const float Gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
   const float Gy[] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
 
-  pixel_t *G = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(G == NULL, "calloc");
+  g.G = calloc(width * height * sizeof(pixel_t), 1);
+  DIE(g.G == NULL, "calloc");
 
-  pixel_t *after_Gx = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(after_Gx == NULL, "calloc");
+  g.after_Gx = calloc(width * height * sizeof(pixel_t), 1);
+  DIE(g.after_Gx == NULL, "calloc");
 
-  pixel_t *after_Gy = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(after_Gy == NULL, "calloc");
+  g.after_Gy = calloc(width * height * sizeof(pixel_t), 1);
+  DIE(g.after_Gy == NULL, "calloc");
 
-  pixel_t *nms = calloc(width * height * sizeof(pixel_t), 1);
-  DIE(nms == NULL, "calloc");
+  /* Zeroed like the other buffers: the blur leaves its border unwritten. */
+  pixel_t *out = calloc(width * height * sizeof(pixel_t), 1);
+  DIE(out == NULL, "calloc");
+
+  if (sigma > 0)
+    gaussian_filter(in, out, width, height, sigma, recursive);
+  else
+    for (i = 0; i < width * height; i++)
+      out[i] = (pixel_t)in[i];
 
-  pixel_t *out = malloc(width * height * sizeof(pixel_t));
-  DIE(out == NULL, "malloc");
+  convolution(out, g.after_Gx, Gx, width, height, 3, false);
 
-  pixel_t *pixels = malloc(width * height * sizeof(pixel_t));
-  DIE(pixels == NULL, "malloc");
+  convolution(out, g.after_Gy, Gy, width, height, 3, false);
+
+  for (i = 1; i < width - 1; i++) {
+    for (j = 1; j < height - 1; j++) {
+      const int c = i + width * j;
+      g.G[c] = (pixel_t)hypot(g.after_Gx[c], g.after_Gy[c]);
 
-  /* Convert to pixel_t. */
-  for (i = 0; i < width * height; i++) {
-    pixels[i] = (pixel_t)in[i];
+      if (hist)
+        hist[adaptive_bin(g.G[c])]++;
+    }
   }
 
-  gaussian_filter(pixels, out, width, height, sigma);
+  free(out);
+
+  return g;
+}
+
+static void
+gradient_free(gradient_t *g)
+{
+  free(g->G);
+  free(g->after_Gx);
+  free(g->after_Gy);
+}
+
+/*
+ * Whether pixel c is a local maximum along its gradient direction.
+ */
+static inline bool
+canny_is_maximum(const gradient_t *g, const int c, const int width)
+{
+  const pixel_t *G = g->G;
+  const int nn = c - width;
+  const int ss = c + width;
+  const int ww = c + 1;
+  const int ee = c - 1;
+  const int nw = nn + 1;
+  const int ne = nn - 1;
+  const int sw = ss + 1;
+  const int se = ss - 1;
+  const float dir = (float) (fmod(atan2(g->after_Gy[c], g->after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
+
+  return ((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
+         ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
+         ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
+         ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]);   // 135 deg
+}
 
-  convolution(out, after_Gx, Gx, width, height, 3, false);
+/*
+ * Non-maximum suppression, straightforward implementation. Returns the
+ * magnitude of the local maxima, 0 elsewhere.
+ */
+static pixel_t *
+canny_non_maximum_suppression(const gradient_t *g,
+                              const int         width,
+                              const int         height)
+{
+  int i, j;
 
-  convolution(out, after_Gy, Gy, width, height, 3, false);
+  pixel_t *nms = calloc(width * height * sizeof(pixel_t), 1);
+  DIE(nms == NULL, "calloc");
 
   for (i = 1; i < width - 1; i++) {
     for (j = 1; j < height - 1; j++) {
       const int c = i + width * j;
-      G[c] = (pixel_t)hypot(after_Gx[c], after_Gy[c]);
+      nms[c] = canny_is_maximum(g, c, width) ? g->G[c] : 0;
     }
   }
 
-  /* Non-maximum suppression, straightforward implementation. */
-  for (i = 1; i < width - 1; i++) {
-    for (j = 1; j < height - 1; j++) {
+  return nms;
+}
+
+/*
+ * Non-maximum suppression that classifies every pixel straight into the bit
+ * planes of hy. Pixels below T1 are discarded before the direction is even
+ * computed.
+ */
+static void
+canny_classify(const gradient_t *g,
+               const int         width,
+               const int         height,
+               const int         t1,
+               const int         t2,
+               hysteresis_t     *hy)
+{
+  int i, j;
+
+  for (j = 1; j < height - 1; j++) {
+    for (i = 1; i < width - 1; i++) {
       const int c = i + width * j;
-      const int nn = c - width;
-      const int ss = c + width;
-      const int ww = c + 1;
-      const int ee = c - 1;
-      const int nw = nn + 1;
-      const int ne = nn - 1;
-      const int sw = ss + 1;
-      const int se = ss - 1;
-      const float dir = (float) (fmod(atan2(after_Gy[c], after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
-
-      if (((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
-          ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
-          ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
-          ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]))   // 135 deg
-        nms[c] = G[c];
-      else
-        nms[c] = 0;
+      const pixel_t nms = g->G[c] >= t1 && canny_is_maximum(g, c, width) ? g->G[c] : 0;
+
+      hysteresis_mark(hy, i, j, nms, t1, t2);
     }
   }
+}
+
+/*
+ * Tracing edges with hysteresis, one edge at a time, so that the edges can be
+ * recorded as contours in tracing order.
+ *
+ * Note: T1 and T2 are lower and upper thresholds.
+ */
+static uint8_t *
+canny_trace(const pixel_t *nms,
+            const int      width,
+            const int      height,
+            const int      t1,
+            const int      t2,
+            contours_t    *contours)
+{
+  int i, j, k, nedges;
+  int *edges;
+  size_t t = 1;
 
-  /* Reuse the array used as a stack, width * height / 2 elements should be enough. */
-  edges = (int *) after_Gy;
-  memset(out, 0, sizeof(pixel_t) * width * height);
-  memset(edges, 0, sizeof(pixel_t) * width * height);
+  uint8_t *out = calloc(width * height * sizeof(uint8_t), 1);
+  DIE(out == NULL, "calloc");
 
-  /* Tracing edges with hysteresis. Non-recursive implementation. */
+  /* Used as a stack; a pixel is pushed at most once. */
+  edges = malloc(width * height * sizeof(int));
+  DIE(edges == NULL, "malloc");
+
+  /* Non-recursive implementation. */
   for (j = 1; j < height - 1; j++) {
     for (i = 1; i < width - 1; i++) {
       /* Trace edges. */
@@ -185,10 +306,14 @@ canny_edge_detection(const uint8_t *in,
         nedges = 1;
         edges[0] = t;
 
+        contours_begin(contours);
+
         do {
           nedges--;
           const int e = edges[nedges];
 
+          contours_add(contours, e);
+
           int nbs[8]; // neighbours
           nbs[0] = e - width;     // nn
           nbs[1] = e + width;     // ss
@@ -200,7 +325,8 @@ canny_edge_detection(const uint8_t *in,
           nbs[7] = nbs[1] - 1; // se
 
           for (k = 0; k < 8; k++) {
-            if (nms[nbs[k]] >= t1 && out[nbs[k]] == 0) {
+            if (hysteresis_interior(nbs[k], width, height) &&
+                nms[nbs[k]] >= t1 && out[nbs[k]] == 0) {
               out[nbs[k]] = MAX_BRIGHTNESS;
               edges[nedges] = nbs[k];
               nedges++;
@@ -212,20 +338,61 @@ canny_edge_detection(const uint8_t *in,
     }
   }
 
-  retval = malloc(width * height * sizeof(uint8_t));
-  DIE(retval == NULL, "malloc");
+  free(edges);
+
+  return out;
+}
+
+/*
+ * Edges of an already computed gradient. If contours is not NULL, every
+ * traced edge is also recorded as a contour; otherwise the bit-packed
+ * hysteresis is used.
+ */
+static uint8_t *
+canny_edges(const gradient_t *g,
+            const int         width,
+            const int         height,
+            const int         t1,
+            const int         t2,
+            contours_t       *contours)
+{
+  uint8_t *retval;
 
-  /* Convert back to uint8_t */
-  for (i = 0; i < width * height; i++) {
-    retval[i] = (uint8_t)out[i];
+  if (contours) {
+    pixel_t *nms = canny_non_maximum_suppression(g, width, height);
+
+    retval = canny_trace(nms, width, height, t1, t2, contours);
+    free(nms);
+  } else {
+    hysteresis_t *hy = hysteresis_create(width, height);
+
+    canny_classify(g, width, height, t1, t2, hy);
+    hysteresis_run(hy);
+
+    retval = malloc(width * height * sizeof(uint8_t));
+    DIE(retval == NULL, "malloc");
+
+    hysteresis_output(hy, retval);
+    hysteresis_free(hy);
   }
 
-  free(after_Gx);
-  free(after_Gy);
-  free(G);
-  free(nms);
-  free(pixels);
-  free(out);
+  return retval;
+}
+
+static uint8_t *
+canny_edge_detection(const uint8_t *in,
+                     const int      width,
+                     const int      height,
+                     const int      t1,
+                     const int      t2,
+                     const float    sigma,
+                     const bool     recursive,
+                     contours_t    *contours)
+{
+  gradient_t g = canny_gradient(in, width, height, sigma, recursive, NULL);
+  uint8_t *retval = canny_edges(&g, width, height, t1, t2, contours);
+
+  gradient_free(&g);
 
   return retval;
 }
@@ -233,58 +400,409 @@ canny_edge_detection(const uint8_t *in,
 static void
 print_usage(const char *argv0)
 {
-  fprintf(stderr, "Usage: %s <IN.mpg> [OUT.mpg]\n", argv0);
+  fprintf(stderr, "Usage: %s [-e EDGES] [-c MODE] [-o CONTOURS] [-i] [-m] [-p FACTOR] [-s SIGMA] [-r] [-t LIST] [-a MODE] [-l] [-g] [-P] [-f RANGE] [-R ROI] <IN.mpg> [OUT.mpg]\n", argv0);
   fprintf(stderr, "Required arguments:\n"
                   "  <IN.mpg>\tthe input video file\n"
                   "Optional arguments:\n"
-                  "  [OUT.mpg]\tthe output video file\n");
+                  "  [OUT.mpg]\tthe output video file\n"
+                  "  -e EDGES\twrite bit-packed edge maps to EDGES instead of encoding\n"
+                  "  -c MODE\tedge map compression: none, rle or delta (default: rle)\n"
+                  "  -o CONTOURS\twrite the traced edge contours to CONTOURS\n"
+                  "  -i\t\tonly reprocess the regions that changed since the previous frame\n"
+                  "  -m\t\tlike -i, but trust the decoder's motion vectors to skip still\n"
+                  "    \t\tmacroblocks (approximate, needs a decoder exporting them)\n"
+                  "  -p FACTOR\tfast preview: detect edges on the frame downscaled by 2 or 4\n"
+                  "  -s SIGMA\tGaussian blur sigma, at least 0.5 (default: 1.0)\n"
+                  "  -r\t\tuse a recursive Gaussian, whose cost does not depend on sigma\n"
+                  "  -t LIST\tthreshold sweep: trace every LOWER:UPPER pair of the comma-\n"
+                  "    \t\tseparated LIST, writing each to EDGES.LOWER-UPPER (needs -e)\n"
+                  "  -a MODE\tpick the thresholds of every frame from its gradient histogram:\n"
+                  "    \t\totsu, or the percentile of the upper threshold (1 to 99)\n"
+                  "  -l\t\tstream every frame row by row through rolling line buffers\n"
+                  "  -g\t\tencode the edges with constant neutral chroma, cheaper to encode\n"
+                  "  -P\t\tdecode and encode on a codec thread, alongside edge detection\n"
+                  "  -f RANGE\tonly process the frames START:END[:STRIDE], counted from 0,\n"
+                  "    \t\tand stop decoding at END\n"
+                  "  -R ROI\tonly detect edges in ROI, rectangles WxH+X+Y[,...] or a PGM mask\n");
 }
 
 int main(int argc, char **argv)
 {
   const char *file_in;
   const char *file_out;
+  const char *file_edges = NULL;
+  const char *file_contours = NULL;
 
   DeContext *context;
   DeFrame *frame = NULL;
+  codec_t codec;
+  edgemap_t *edgemap = NULL;
+  contours_t contours = {0};
+  FILE *contours_file = NULL;
+  incremental_t *inc = NULL;
+  stream_t *stream = NULL;
+  motion_t *motion = NULL;
+  bool incremental = false;
+  bool use_motion = false;
+  bool streaming = false;
+  bool gray = false;
+  bool pipelined = false;
+  int preview = 1;
+  float sigma = CANNY_SIGMA;
+  bool recursive = false;
+  int lower = CANNY_LOWER;
+  int upper = CANNY_UPPER;
+  int adaptive = -1;
+  sweep_t sweep = {0};
+  uint8_t *swept[SWEEP_MAX];
+  uint8_t *edges, *small = NULL;
+  frames_t frames = FRAMES_ALL;
+  roi_t roi = {0};
+  long frame_index = 0;
   int got_frame = 0;
+  int compression = EDGEMAP_RLE;
+  int opt;
 
   struct timespec start, end;
   double time_per_frame, computational_time = 0;
 
-  if (argc < 2 || argc > 3) {
+  while ((opt = getopt(argc, argv, "e:c:o:imp:s:rt:a:lgPf:R:")) != -1) {
+    switch (opt) {
+    case 'e':
+      file_edges = optarg;
+      break;
+    case 'c':
+      compression = edgemap_parse_compression(optarg);
+      if (compression < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'o':
+      file_contours = optarg;
+      break;
+    case 'i':
+      incremental = true;
+      break;
+    case 'm':
+      incremental = use_motion = true;
+      break;
+    case 'p':
+      preview = atoi(optarg);
+      if (preview != 2 && preview != 4) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 's':
+      sigma = atof(optarg);
+      if (sigma < 0.5) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'r':
+      recursive = true;
+      break;
+    case 'a':
+      adaptive = adaptive_parse(optarg);
+      if (adaptive < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 't':
+      if (sweep_parse(&sweep, optarg) < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'l':
+      streaming = true;
+      break;
+    case 'g':
+      gray = true;
+      break;
+    case 'P':
+      pipelined = true;
+      break;
+    case 'f':
+      if (frames_parse(&frames, optarg) < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'R':
+      if (roi_parse(&roi, optarg) < 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (argc - optind < 1 || argc - optind > 2) {
     print_usage(argv[0]);
     exit(1);
   }
 
-  file_in = argv[1];
-  file_out = argc == 3 ? argv[2] : "out.mpg";
+  /* The incremental tracer does not record contours nor downscale. */
+  if (incremental && (file_contours || preview > 1)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  /* Both the incremental engine and the preview blur with a kernel. */
+  if (recursive && (incremental || preview > 1)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  /* Every pair gets its own edge map file, and only the plain pipeline is swept. */
+  if (sweep.n > 0 && (file_edges == NULL || incremental || preview > 1 || file_contours)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  /* Adaptive thresholds replace both the fixed and the swept ones. */
+  if (adaptive >= 0 && (incremental || preview > 1 || sweep.n > 0)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  /* Streaming runs the plain pipeline only, with the direct Gaussian. */
+  if (streaming && (incremental || preview > 1 || recursive || sweep.n > 0 || adaptive >= 0 ||
+                    file_contours)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  /* Motion vectors refer to the previous decoded frame, not to the previous selected one. */
+  if (use_motion && frames.stride > 1) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  /* The region is applied by the incremental engine, with the same limits. */
+  if (roi_active(&roi) && (file_contours || preview > 1 || recursive || sweep.n > 0 ||
+                           adaptive >= 0 || streaming)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  if (preview > 1) {
+    const float scale = preview_threshold_scale(sigma, preview);
+
+    lower = (int) (CANNY_LOWER * scale + 0.5);
+    upper = (int) (CANNY_UPPER * scale + 0.5);
+  }
+
+  file_in = argv[optind];
+  file_out = argc - optind == 2 ? argv[optind + 1] : "out.mpg";
 
   context = de_context_create(file_in);
-  de_context_prepare_encoding(context, file_out);
+
+  /* The edge map sink replaces the encoder entirely. */
+  if (sweep.n > 0)
+    sweep_create(&sweep, file_edges, compression);
+  else if (file_edges)
+    edgemap = edgemap_create(file_edges, compression);
+  else
+    de_context_prepare_encoding(context, file_out);
+
+  if (file_contours)
+    contours_file = contours_create(file_contours);
+
+  codec_init(&codec, context, pipelined);
 
   do {
-    frame = de_context_get_next_frame(context, &got_frame);
+    if (frames_done(&frames, frame_index))
+      got_frame = -1;
+    else
+      frame = codec_get_next_frame(&codec, &got_frame);
 
     if (got_frame == -1)
       break;
 
+    if (got_frame && frame && !frames_selected(&frames, frame_index++))
+      continue;
+
     if (got_frame && frame) {
+      int width = frame->width;
+      int height = frame->height;
+
       DIE(clock_gettime(CLOCK_MONOTONIC, &start) == -1, "clock_gettime");
-      frame->frame->data[0] = canny_edge_detection(frame->data, frame->width, frame->height,
-                                                   CANNY_LOWER, CANNY_UPPER, CANNY_SIGMA);
+
+      if (incremental || roi_active(&roi)) {
+        const uint8_t *clean = NULL;
+
+        if (inc && (inc->width != frame->width || inc->height != frame->height)) {
+          incremental_free(inc);
+          inc = NULL;
+        }
+
+        if (inc == NULL) {
+          inc = incremental_create(frame->width, frame->height, sigma, 1);
+          if (roi_active(&roi))
+            incremental_set_roi(inc, &roi);
+        }
+
+        /* Without -i, the region is detected afresh in every frame. */
+        if (!incremental)
+          incremental_invalidate(inc);
+
+        if (use_motion) {
+          if (motion == NULL)
+            motion = motion_create(frame->width, frame->height);
+
+          if (motion_clean_tiles(motion, frame->frame, INCREMENTAL_TILE, inc->ntx, inc->nty, inc->clean))
+            clean = inc->clean;
+        }
+
+        edges = malloc(frame->width * frame->height * sizeof(uint8_t));
+        DIE(edges == NULL, "malloc");
+
+        memcpy(edges, incremental_canny_edge_detection(inc, frame->data, clean, CANNY_LOWER, CANNY_UPPER),
+               frame->width * frame->height * sizeof(uint8_t));
+      } else if (streaming) {
+        if (stream && (stream->width != frame->width || stream->height != frame->height)) {
+          stream_free(stream);
+          stream = NULL;
+        }
+
+        if (stream == NULL)
+          stream = stream_create(frame->width, frame->height, sigma, CANNY_LOWER, CANNY_UPPER, 1);
+
+        edges = malloc(frame->width * frame->height * sizeof(uint8_t));
+        DIE(edges == NULL, "malloc");
+
+        stream_frame(stream, frame->data, edges);
+      } else if (preview > 1) {
+        width /= preview;
+        height /= preview;
+
+        small = realloc(small, width * height * sizeof(uint8_t));
+        DIE(small == NULL, "realloc");
+
+        preview_downsample(frame->data, small, frame->width, frame->height, preview, sigma,
+                           0, height, 1);
+
+        if (contours_file)
+          contours_reset(&contours, width, 0, 0, height);
+
+        edges = canny_edge_detection(small, width, height, lower, upper, 0, false,
+                                     contours_file ? &contours : NULL);
+
+        /* The encoder needs full-size frames, the edge map sink does not. */
+        if (edgemap == NULL) {
+          uint8_t *full = malloc(frame->width * frame->height * sizeof(uint8_t));
+          DIE(full == NULL, "malloc");
+
+          preview_upsample(edges, full, frame->width, frame->height, preview,
+                           0, frame->height, 1);
+          free(edges);
+          edges = full;
+        }
+      } else if (sweep.n > 0) {
+        gradient_t g = canny_gradient(frame->data, frame->width, frame->height,
+                                      sigma, recursive, NULL);
+        pixel_t *nms = canny_non_maximum_suppression(&g, width, height);
+        hysteresis_t *hy = hysteresis_create(width, height);
+
+        for (int i = 0; i < sweep.n; i++) {
+          swept[i] = malloc(width * height * sizeof(uint8_t));
+          DIE(swept[i] == NULL, "malloc");
+
+          hysteresis_classify(hy, nms, sweep.lower[i], sweep.upper[i]);
+          hysteresis_run(hy);
+          hysteresis_output(hy, swept[i]);
+        }
+
+        hysteresis_free(hy);
+        free(nms);
+        gradient_free(&g);
+      } else if (adaptive >= 0) {
+        unsigned int hist[ADAPTIVE_BINS] = {0};
+        gradient_t g = canny_gradient(frame->data, frame->width, frame->height,
+                                      sigma, recursive, hist);
+
+        adaptive_thresholds(hist, adaptive, CANNY_LOWER, CANNY_UPPER, &lower, &upper);
+
+        if (contours_file)
+          contours_reset(&contours, frame->width, 0, 0, frame->height);
+
+        edges = canny_edges(&g, frame->width, frame->height, lower, upper,
+                            contours_file ? &contours : NULL);
+        gradient_free(&g);
+      } else {
+        if (contours_file)
+          contours_reset(&contours, frame->width, 0, 0, frame->height);
+
+        edges = canny_edge_detection(frame->data, frame->width, frame->height,
+                                     CANNY_LOWER, CANNY_UPPER, sigma, recursive,
+                                     contours_file ? &contours : NULL);
+      }
+
       DIE(clock_gettime(CLOCK_MONOTONIC, &end) == -1, "clock_gettime");
 
       time_per_frame = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
       printf("Time per frame: %lf\n", time_per_frame);
       computational_time += time_per_frame;
 
-      de_context_set_next_frame(context, frame);
+      if (adaptive >= 0)
+        printf("Thresholds: %d %d\n", lower, upper);
+
+      if (contours_file)
+        contours_write_frame(contours_file, &contours, 1, width, height);
+
+      if (sweep.n > 0) {
+        for (int i = 0; i < sweep.n; i++) {
+          edgemap_write_frame(sweep.maps[i], swept[i], width, height);
+          free(swept[i]);
+        }
+      } else if (edgemap) {
+        edgemap_write_frame(edgemap, edges, width, height);
+        free(edges);
+      } else {
+        frame->frame->data[0] = edges;
+        if (gray)
+          codec_neutral_chroma(frame->frame, frame->height);
+        codec_set_next_frame(&codec, frame);
+      }
     }
   } while (1);
 
-  de_context_end_encoding(context);
+  codec_finish(&codec);
+
+  if (sweep.n > 0)
+    sweep_close(&sweep);
+  else if (edgemap)
+    edgemap_close(edgemap);
+  else
+    CODEC_TIMED(codec.time, de_context_end_encoding(context));
+
+  if (contours_file) {
+    DIE(fclose(contours_file) != 0, "fclose");
+    contours_free(&contours);
+  }
+
+  if (inc) {
+    printf("Recomputed tiles: %.2lf%%\n", 100.0 * inc->tiles_dirty / inc->tiles_total);
+    incremental_free(inc);
+  }
+
+  if (motion)
+    motion_free(motion);
+
+  if (stream)
+    stream_free(stream);
+
+  free(small);
 
+  codec_report(&codec, stdout, "");
   printf("Computational time: %lf\n", computational_time);
 
   return 0;
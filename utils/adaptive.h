@@ -0,0 +1,128 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per-frame thresholds derived from the histogram of the gradient magnitude.
+ *
+ * The histogram is filled by the gradient magnitude loop itself, so no extra
+ * pass over the frame is needed. The upper threshold is either a percentile
+ * of the magnitudes or the Otsu threshold between the background and edge
+ * classes; the lower one keeps the ratio between the default thresholds.
+ */
+
+/* Sobel magnitudes of 8-bit input stay below 4 * 255 * sqrt(2) < 1443. */
+#define ADAPTIVE_BINS 2048
+#define ADAPTIVE_OTSU 0
+
+/*
+ * Returns ADAPTIVE_OTSU for "otsu", the percentile for a number in [1, 99],
+ * or -1 if name is neither.
+ */
+static inline int
+adaptive_parse(const char *name)
+{
+  char *end;
+  long percentile;
+
+  if (strcmp(name, "otsu") == 0)
+    return ADAPTIVE_OTSU;
+
+  percentile = strtol(name, &end, 10);
+  if (*name == '\0' || *end != '\0' || percentile < 1 || percentile > 99)
+    return -1;
+
+  return percentile;
+}
+
+static inline int
+adaptive_bin(const int magnitude)
+{
+  return magnitude < ADAPTIVE_BINS ? magnitude : ADAPTIVE_BINS - 1;
+}
+
+/*
+ * Otsu's method: the magnitude that maximizes the between-class variance.
+ */
+static inline int
+adaptive_otsu(const unsigned int *hist)
+{
+  double total = 0, sum = 0, sum_bg = 0, weight_bg = 0, best = -1;
+  int i, threshold = 0;
+
+  for (i = 0; i < ADAPTIVE_BINS; i++) {
+    total += hist[i];
+    sum += (double) i * hist[i];
+  }
+
+  for (i = 0; i < ADAPTIVE_BINS; i++) {
+    double weight_fg, mean_bg, mean_fg, between;
+
+    weight_bg += hist[i];
+    if (weight_bg == 0)
+      continue;
+
+    weight_fg = total - weight_bg;
+    if (weight_fg == 0)
+      break;
+
+    sum_bg += (double) i * hist[i];
+    mean_bg = sum_bg / weight_bg;
+    mean_fg = (sum - sum_bg) / weight_fg;
+    between = weight_bg * weight_fg * (mean_bg - mean_fg) * (mean_bg - mean_fg);
+
+    if (between > best) {
+      best = between;
+      threshold = i + 1;
+    }
+  }
+
+  return threshold;
+}
+
+/*
+ * The smallest magnitude above percentile percent of the pixels.
+ */
+static inline int
+adaptive_percentile(const unsigned int *hist, const int percentile)
+{
+  unsigned long long total = 0, count = 0;
+  int i;
+
+  for (i = 0; i < ADAPTIVE_BINS; i++)
+    total += hist[i];
+
+  for (i = 0; i < ADAPTIVE_BINS; i++) {
+    count += hist[i];
+    if (count * 100 >= total * percentile)
+      return i + 1;
+  }
+
+  return ADAPTIVE_BINS;
+}
+
+/*
+ * Set *t1 and *t2 from hist for the given mode, the lower threshold being
+ * lower / upper times the upper one. Neither goes below 1, since a threshold
+ * of 0 would make every suppressed pixel an edge.
+ */
+static inline void
+adaptive_thresholds(const unsigned int *hist,
+                    const int           mode,
+                    const int           lower,
+                    const int           upper,
+                    int                *t1,
+                    int                *t2)
+{
+  *t2 = mode == ADAPTIVE_OTSU ? adaptive_otsu(hist) : adaptive_percentile(hist, mode);
+  if (*t2 < 1)
+    *t2 = 1;
+
+  *t1 = *t2 * lower / upper;
+  if (*t1 < 1)
+    *t1 = 1;
+}
+
+#endif
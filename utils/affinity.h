@@ -0,0 +1,181 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+/*
+ * Thread placement.
+ *
+ * Thread i of a backend is pinned to the i-th CPU of a list, wrapping around
+ * if there are more threads than CPUs. The list is either given explicitly,
+ * e.g. "0-7,16-23", or derived from the socket topology in sysfs among the
+ * CPUs the process may run on:
+ *
+ *   compact  fill a socket, one core and its SMT siblings at a time, before
+ *            moving to the next one
+ *   scatter  go round the sockets, one core at a time, and only use the SMT
+ *            siblings once every core has a thread
+ *
+ * Pinned threads keep the pages they touch first on their own node, which is
+ * what the first-touch allocations of scratch.h rely on.
+ */
+
+typedef struct {
+  int n;
+  int cpus[CPU_SETSIZE];
+} affinity_t;
+
+typedef struct {
+  int cpu, package, core, sibling;
+} affinity_cpu_t;
+
+static inline int
+affinity_read_topology(const int cpu, const char *name)
+{
+  char path[128];
+  int value = 0;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+
+  if (fscanf(f, "%d", &value) != 1)
+    value = 0;
+  fclose(f);
+
+  return value;
+}
+
+static inline int
+affinity_compare_compact(const void *a, const void *b)
+{
+  const affinity_cpu_t *x = a, *y = b;
+
+  if (x->package != y->package)
+    return x->package - y->package;
+  if (x->core != y->core)
+    return x->core - y->core;
+  return x->cpu - y->cpu;
+}
+
+static inline int
+affinity_compare_scatter(const void *a, const void *b)
+{
+  const affinity_cpu_t *x = a, *y = b;
+
+  if (x->sibling != y->sibling)
+    return x->sibling - y->sibling;
+  if (x->core != y->core)
+    return x->core - y->core;
+  if (x->package != y->package)
+    return x->package - y->package;
+  return x->cpu - y->cpu;
+}
+
+/*
+ * Parse a comma-separated list of CPUs and CPU ranges, e.g. "0,2,4-7".
+ */
+static inline int
+affinity_parse_list(affinity_t *a, const char *list)
+{
+  const char *p = list;
+  int first, last, len, cpu;
+
+  a->n = 0;
+
+  while (*p) {
+    if (sscanf(p, "%d%n", &first, &len) != 1 || first < 0)
+      return -1;
+    p += len;
+
+    last = first;
+    if (*p == '-') {
+      if (sscanf(p + 1, "%d%n", &last, &len) != 1 || last < first)
+        return -1;
+      p += 1 + len;
+    }
+
+    if (last >= CPU_SETSIZE)
+      return -1;
+
+    for (cpu = first; cpu <= last; cpu++) {
+      if (a->n == CPU_SETSIZE)
+        return -1;
+      a->cpus[a->n++] = cpu;
+    }
+
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+  }
+
+  return a->n > 0 ? 0 : -1;
+}
+
+/*
+ * Fill a from "compact", "scatter" or a CPU list. Returns 0 on success, -1
+ * if spec is none of these.
+ */
+static inline int
+affinity_parse(affinity_t *a, const char *spec)
+{
+  static affinity_cpu_t cpus[CPU_SETSIZE];
+  cpu_set_t allowed;
+  int cpu, i, n = 0;
+
+  if (strcmp(spec, "compact") != 0 && strcmp(spec, "scatter") != 0)
+    return affinity_parse_list(a, spec);
+
+  DIE(sched_getaffinity(0, sizeof(allowed), &allowed) < 0, "sched_getaffinity");
+
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+
+    cpus[n].cpu = cpu;
+    cpus[n].package = affinity_read_topology(cpu, "physical_package_id");
+    cpus[n].core = affinity_read_topology(cpu, "core_id");
+    cpus[n].sibling = 0;
+
+    /* SMT siblings come in increasing CPU order. */
+    for (i = 0; i < n; i++) {
+      if (cpus[i].package == cpus[n].package && cpus[i].core == cpus[n].core)
+        cpus[n].sibling++;
+    }
+
+    n++;
+  }
+
+  qsort(cpus, n, sizeof(affinity_cpu_t),
+        strcmp(spec, "compact") == 0 ? affinity_compare_compact : affinity_compare_scatter);
+
+  a->n = n;
+  for (i = 0; i < n; i++)
+    a->cpus[i] = cpus[i].cpu;
+
+  return 0;
+}
+
+/*
+ * Pin the calling thread, thread i, to its CPU.
+ */
+static inline void
+affinity_pin(const affinity_t *a, const int i)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(a->cpus[i % a->n], &set);
+
+  DIE(sched_setaffinity(0, sizeof(set), &set) < 0, "sched_setaffinity");
+}
+
+#endif
@@ -0,0 +1,335 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <libavutil/frame.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../libde/de.h"
+#include "utils.h"
+
+/*
+ * Time spent in libde, decoding and encoding, as opposed to detecting edges.
+ *
+ * libde sets its decoder and encoder up with the codecs' default threading,
+ * which it does not let the drivers change, so once the edge detection runs
+ * on many cores the codec easily becomes the bottleneck. The drivers report
+ * both times so that it shows.
+ *
+ * What the drivers can change is when the codec runs. Pipelined, a codec
+ * thread makes the decoding and encoding calls on the context: it decodes up
+ * to CODEC_AHEAD frames ahead and encodes the frames the driver is done with,
+ * while the driver detects the edges of the next one. The driver then only
+ * waits for the codec when the codec is the slower of the two, and reports
+ * that wait besides the time spent in libde. libde decodes every frame into
+ * the same buffers, so the codec thread hands the driver a copy of its own,
+ * which stays valid like a libde frame does: until the frame is encoded or
+ * the next one is taken.
+ *
+ * The drivers can also make the encoder's job cheaper by handing it less to
+ * encode: the edges are luma only, yet every frame still carries the
+ * source's chroma, which costs bits and motion search on every frame. With
+ * codec_neutral_chroma() both chroma planes are a constant grey, the same in
+ * every frame, so that after the first one they are coded as skipped blocks.
+ */
+
+#define CODEC_NEUTRAL_CHROMA 128
+
+/* Frames the codec thread decodes ahead, and frames waiting for the encoder. */
+#define CODEC_AHEAD 2
+
+static inline double
+codec_clock(void)
+{
+  struct timespec now;
+
+  DIE(clock_gettime(CLOCK_MONOTONIC, &now) == -1, "clock_gettime");
+
+  return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+/* Make a libde call, adding the time it takes to total. */
+#define CODEC_TIMED(total, call)                    \
+  do {                                              \
+    const double codec_start_ = codec_clock();      \
+    call;                                           \
+    (total) += codec_clock() - codec_start_;        \
+  } while (0)
+
+typedef struct {
+  DeContext *context;
+  bool pipelined;
+  double time;              // spent in libde
+  double wait;              // spent by the driver waiting for the codec thread
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  DeFrame *decoded[CODEC_AHEAD];     // ring of frames not taken yet
+  int ndecoded, first_decoded;
+  DeFrame *encoded[CODEC_AHEAD];     // ring of frames to encode, in order
+  int nencoded, first_encoded;
+  DeFrame *taken;           // the driver's frame, unless queued for encoding
+
+  bool eof;                 // the decoder has no more frames
+  bool done;                // the driver takes no more frames
+} codec_t;
+
+/* A copy of a decoded frame, for the driver to keep while libde decodes on. */
+typedef struct {
+  DeFrame frame;
+  uint8_t *luma;            // the copy's own luma plane
+} codec_frame_t;
+
+static inline DeFrame *
+codec_copy_frame(const DeFrame *src)
+{
+  const size_t size = (size_t) src->width * src->height;
+  codec_frame_t *copy = malloc(sizeof(codec_frame_t));
+  DIE(copy == NULL, "malloc");
+
+  copy->frame = *src;
+
+  /* Writable, since the drivers write the edges into the luma plane. */
+  copy->frame.frame = av_frame_clone(src->frame);
+  DIE(copy->frame.frame == NULL, "av_frame_clone");
+  DIE(av_frame_make_writable(copy->frame.frame) < 0, "av_frame_make_writable");
+  copy->luma = copy->frame.frame->data[0];
+
+  copy->frame.data = malloc(size);
+  DIE(copy->frame.data == NULL, "malloc");
+  memcpy(copy->frame.data, src->data, size);
+
+  return &copy->frame;
+}
+
+/*
+ * Free a copy. A luma plane the driver put in its place is the driver's, as
+ * it is with a libde frame.
+ */
+static inline void
+codec_free_frame(DeFrame *frame)
+{
+  codec_frame_t *copy = (codec_frame_t *) frame;
+
+  if (frame == NULL)
+    return;
+
+  frame->frame->data[0] = copy->luma;
+  av_frame_free(&frame->frame);
+  free(frame->data);
+  free(copy);
+}
+
+/*
+ * The codec thread. Encoding goes first, so that finished frames go out and
+ * the driver is never held up by a full encoding ring.
+ */
+static inline void *
+codec_run(void *arg)
+{
+  codec_t *c = arg;
+  DeFrame *frame;
+  int got_frame;
+
+  pthread_mutex_lock(&c->lock);
+
+  for (;;) {
+    if (c->nencoded > 0) {
+      frame = c->encoded[c->first_encoded];
+      pthread_mutex_unlock(&c->lock);
+
+      CODEC_TIMED(c->time, de_context_set_next_frame(c->context, frame));
+      codec_free_frame(frame);
+
+      pthread_mutex_lock(&c->lock);
+      c->first_encoded = (c->first_encoded + 1) % CODEC_AHEAD;
+      c->nencoded--;
+      pthread_cond_broadcast(&c->cond);
+    } else if (!c->done && !c->eof && c->ndecoded < CODEC_AHEAD) {
+      pthread_mutex_unlock(&c->lock);
+
+      got_frame = 0;
+      CODEC_TIMED(c->time, frame = de_context_get_next_frame(c->context, &got_frame));
+      if (got_frame > 0 && frame)
+        frame = codec_copy_frame(frame);
+
+      pthread_mutex_lock(&c->lock);
+      if (got_frame == -1) {
+        c->eof = true;
+      } else if (got_frame && frame) {
+        c->decoded[(c->first_decoded + c->ndecoded) % CODEC_AHEAD] = frame;
+        c->ndecoded++;
+      }
+      pthread_cond_broadcast(&c->cond);
+    } else if (c->done) {
+      break;
+    } else {
+      pthread_cond_wait(&c->cond, &c->lock);
+    }
+  }
+
+  pthread_mutex_unlock(&c->lock);
+
+  return NULL;
+}
+
+/*
+ * Drive libde through c, from a codec thread if pipelined, otherwise with
+ * direct calls.
+ */
+static inline void
+codec_init(codec_t *c, DeContext *context, const bool pipelined)
+{
+  *c = (codec_t) {
+    .context = context,
+    .pipelined = pipelined,
+  };
+
+  if (!pipelined)
+    return;
+
+  DIE(pthread_mutex_init(&c->lock, NULL) != 0, "pthread_mutex_init");
+  DIE(pthread_cond_init(&c->cond, NULL) != 0, "pthread_cond_init");
+  DIE(pthread_create(&c->thread, NULL, codec_run, c) != 0, "pthread_create");
+}
+
+/*
+ * de_context_get_next_frame(), or the next frame the codec thread decoded.
+ * The codec thread leaves out the calls that return no frame, so pipelined,
+ * got_frame is always 1, or -1 at the end. The previous frame goes, unless
+ * it was queued for encoding.
+ */
+static inline DeFrame *
+codec_get_next_frame(codec_t *c, int *got_frame)
+{
+  const double start = codec_clock();
+  DeFrame *frame = NULL;
+
+  if (!c->pipelined) {
+    frame = de_context_get_next_frame(c->context, got_frame);
+    c->time += codec_clock() - start;
+    return frame;
+  }
+
+  codec_free_frame(c->taken);
+  c->taken = NULL;
+
+  pthread_mutex_lock(&c->lock);
+
+  while (c->ndecoded == 0 && !c->eof)
+    pthread_cond_wait(&c->cond, &c->lock);
+
+  *got_frame = -1;
+  if (c->ndecoded > 0) {
+    frame = c->decoded[c->first_decoded];
+    c->first_decoded = (c->first_decoded + 1) % CODEC_AHEAD;
+    c->ndecoded--;
+    *got_frame = 1;
+    pthread_cond_broadcast(&c->cond);
+  }
+
+  pthread_mutex_unlock(&c->lock);
+
+  c->taken = frame;
+  c->wait += codec_clock() - start;
+
+  return frame;
+}
+
+/* de_context_set_next_frame(), or queue the frame for the codec thread. */
+static inline void
+codec_set_next_frame(codec_t *c, DeFrame *frame)
+{
+  const double start = codec_clock();
+
+  if (!c->pipelined) {
+    de_context_set_next_frame(c->context, frame);
+    c->time += codec_clock() - start;
+    return;
+  }
+
+  pthread_mutex_lock(&c->lock);
+
+  while (c->nencoded == CODEC_AHEAD)
+    pthread_cond_wait(&c->cond, &c->lock);
+
+  if (frame == c->taken)
+    c->taken = NULL;
+
+  c->encoded[(c->first_encoded + c->nencoded) % CODEC_AHEAD] = frame;
+  c->nencoded++;
+  pthread_cond_broadcast(&c->cond);
+
+  pthread_mutex_unlock(&c->lock);
+
+  c->wait += codec_clock() - start;
+}
+
+/*
+ * Stop the codec thread once the queued frames are encoded, and free the
+ * frames it decoded ahead that were not taken. The context is the driver's again
+ * afterwards, for de_context_end_encoding().
+ */
+static inline void
+codec_finish(codec_t *c)
+{
+  const double start = codec_clock();
+
+  if (!c->pipelined)
+    return;
+
+  pthread_mutex_lock(&c->lock);
+  c->done = true;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+
+  DIE(pthread_join(c->thread, NULL) != 0, "pthread_join");
+
+  c->wait += codec_clock() - start;
+
+  codec_free_frame(c->taken);
+  c->taken = NULL;
+
+  for (; c->ndecoded > 0; c->ndecoded--) {
+    codec_free_frame(c->decoded[c->first_decoded]);
+    c->first_decoded = (c->first_decoded + 1) % CODEC_AHEAD;
+  }
+
+  pthread_cond_destroy(&c->cond);
+  pthread_mutex_destroy(&c->lock);
+}
+
+/*
+ * Print the time spent in libde and, pipelined, the time the driver waited
+ * for it.
+ */
+static inline void
+codec_report(const codec_t *c, FILE *f, const char *tag)
+{
+  fprintf(f, "%sCodec time: %lf\n", tag, c->time);
+  if (c->pipelined)
+    fprintf(f, "%sCodec wait: %lf\n", tag, c->wait);
+}
+
+/*
+ * Make both chroma planes of a 4:2:0 frame neutral grey, before encoding it.
+ */
+static inline void
+codec_neutral_chroma(AVFrame *frame, const int height)
+{
+  const int rows = (height + 1) / 2;
+  int plane;
+
+  for (plane = 1; plane <= 2; plane++) {
+    if (frame->data[plane])
+      memset(frame->data[plane], CODEC_NEUTRAL_CHROMA, (size_t) frame->linesize[plane] * rows);
+  }
+}
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef CONTOURS_H
+#define CONTOURS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+/*
+ * Edge contours recorded while tracing edges with hysteresis.
+ *
+ * The tracer pops edge pixels off its stack in depth-first order, so two
+ * consecutive pixels are neighbours except when it backtracks to a branch.
+ * Every run of neighbouring pixels is stored as a chain: a start point
+ * followed by one Freeman code per step. All chains traced from the same
+ * strong pixel form a contour.
+ *
+ * File layout (integers are written in host byte order):
+ *   header : "CNTR", u32 version
+ *   frames : u32 width, u32 height, u32 edge pixels, u32 contours,
+ *            u32 chains, u32 pixels in the longest contour,
+ *            u64 size of the chain data, chain data
+ *   chain  : u32 x, u32 y, u32 codes (bit 31 set on the first chain of
+ *            a contour), codes packed two per byte, low nibble first
+ *
+ * Freeman codes: 0 = E, 1 = NE, 2 = N, 3 = NW, 4 = W, 5 = SW, 6 = S, 7 = SE,
+ * with y growing downwards.
+ */
+
+#define CONTOURS_VERSION 1
+#define CONTOURS_FIRST_CHAIN 0x80000000u
+
+typedef struct {
+  int width;
+  int y_offset;         // added to every y coordinate when recording
+  int row_begin;        // only rows in [row_begin, row_end) are recorded
+  int row_end;
+
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+
+  size_t chain;         // offset of the current chain's code count
+  uint32_t ncodes;
+  uint32_t chain_flag;
+  bool chain_open;
+  bool contour_open;
+  bool first_chain;
+  int x, y;             // last recorded pixel
+
+  uint32_t npixels;
+  uint32_t ncontours;
+  uint32_t nchains;
+  uint32_t length;      // pixels in the current contour
+  uint32_t max_contour;
+} contours_t;
+
+/*
+ * Prepare c for a new frame (or strip of a frame) of the given width.
+ */
+static inline void
+contours_reset(contours_t *c,
+               const int   width,
+               const int   y_offset,
+               const int   row_begin,
+               const int   row_end)
+{
+  c->width = width;
+  c->y_offset = y_offset;
+  c->row_begin = row_begin;
+  c->row_end = row_end;
+  c->size = 0;
+  c->chain_open = false;
+  c->contour_open = false;
+  c->npixels = c->ncontours = c->nchains = 0;
+  c->length = c->max_contour = 0;
+}
+
+static inline void
+contours_free(contours_t *c)
+{
+  free(c->data);
+  c->data = NULL;
+  c->size = c->capacity = 0;
+}
+
+static inline void
+contours_reserve(contours_t *c, const size_t n)
+{
+  if (c->size + n <= c->capacity)
+    return;
+
+  c->capacity = c->capacity ? c->capacity * 2 : 65536;
+  if (c->capacity < c->size + n)
+    c->capacity = c->size + n;
+
+  c->data = realloc(c->data, c->capacity);
+  DIE(c->data == NULL, "realloc");
+}
+
+/*
+ * Called by the tracer for every strong pixel that starts a new trace.
+ */
+static inline void
+contours_begin(contours_t *c)
+{
+  c->chain_open = false;
+  c->contour_open = false;
+}
+
+/*
+ * Called by the tracer for every edge pixel it pops, index being relative
+ * to the traced image.
+ */
+static inline void
+contours_add(contours_t *c, const int index)
+{
+  static const uint8_t codes[3][3] = {{3, 2, 1}, {4, 0, 0}, {5, 6, 7}};
+  const int y = index / c->width;
+  const int x = index - y * c->width;
+  const int dx = x - c->x;
+  const int dy = y - c->y;
+  uint32_t header[3];
+
+  /* Pixels outside the rows owned by this strip break the chain. */
+  if (y < c->row_begin || y >= c->row_end) {
+    c->chain_open = false;
+    return;
+  }
+
+  if (!c->contour_open) {
+    c->contour_open = true;
+    c->first_chain = true;
+    c->ncontours++;
+    c->length = 0;
+  }
+
+  c->npixels++;
+  if (++c->length > c->max_contour)
+    c->max_contour = c->length;
+
+  if (c->chain_open && dx >= -1 && dx <= 1 && dy >= -1 && dy <= 1 && (dx || dy)) {
+    const uint8_t code = codes[dy + 1][dx + 1];
+
+    if (c->ncodes % 2 == 0) {
+      contours_reserve(c, 1);
+      c->data[c->size++] = code;
+    } else {
+      c->data[c->size - 1] |= code << 4;
+    }
+
+    c->ncodes++;
+    header[0] = c->ncodes | c->chain_flag;
+    memcpy(c->data + c->chain, header, sizeof(uint32_t));
+  } else {
+    /* Start a new chain at this pixel. */
+    c->chain_flag = c->first_chain ? CONTOURS_FIRST_CHAIN : 0;
+    c->first_chain = false;
+
+    header[0] = x;
+    header[1] = y + c->y_offset;
+    header[2] = c->chain_flag;
+
+    contours_reserve(c, sizeof(header));
+    memcpy(c->data + c->size, header, sizeof(header));
+    c->chain = c->size + 2 * sizeof(uint32_t);
+    c->size += sizeof(header);
+
+    c->ncodes = 0;
+    c->chain_open = true;
+    c->nchains++;
+  }
+
+  c->x = x;
+  c->y = y;
+}
+
+static inline FILE *
+contours_create(const char *path)
+{
+  const uint32_t version = CONTOURS_VERSION;
+  FILE *file = fopen(path, "wb");
+  DIE(file == NULL, "fopen");
+
+  DIE(fwrite("CNTR", 1, 4, file) != 4, "fwrite");
+  DIE(fwrite(&version, sizeof(version), 1, file) != 1, "fwrite");
+
+  return file;
+}
+
+/*
+ * Write one frame made of the contours recorded by nparts strips, in order.
+ */
+static inline void
+contours_write_frame(FILE             *file,
+                     const contours_t *parts,
+                     const int         nparts,
+                     const int         width,
+                     const int         height)
+{
+  uint32_t stats[6] = {width, height, 0, 0, 0, 0};
+  uint64_t size = 0;
+  int i;
+
+  for (i = 0; i < nparts; i++) {
+    stats[2] += parts[i].npixels;
+    stats[3] += parts[i].ncontours;
+    stats[4] += parts[i].nchains;
+    if (parts[i].max_contour > stats[5])
+      stats[5] = parts[i].max_contour;
+    size += parts[i].size;
+  }
+
+  DIE(fwrite(stats, sizeof(stats), 1, file) != 1, "fwrite");
+  DIE(fwrite(&size, sizeof(size), 1, file) != 1, "fwrite");
+
+  for (i = 0; i < nparts; i++) {
+    if (parts[i].size > 0)
+      DIE(fwrite(parts[i].data, 1, parts[i].size, file) != parts[i].size, "fwrite");
+  }
+}
+
+#endif
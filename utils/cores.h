@@ -0,0 +1,188 @@
+#ifndef CORES_H
+#define CORES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "utils.h"
+
+/*
+ * Use as few threads as keep up with a throughput target.
+ *
+ * On a shared host, the fastest run is rarely what is wanted: past a few
+ * threads, every extra one buys less (see plots.py), and the cores it takes
+ * could serve another job. So instead of always running NUM threads, the
+ * driver asks the controller how many to use for the next frame. Threads left
+ * out stay parked and leave their cores idle.
+ *
+ * The controller times every frame, from the end of the previous one to the
+ * end of this one, so decoding and encoding count too. Every CORES_WINDOW
+ * frames it folds the mean time into a table of the time per frame at the
+ * current thread count, then moves:
+ *
+ *  - up by half as many threads again if the frames take longer than
+ *    CORES_HEADROOM of the period, unless the table says that the extra
+ *    threads were already tried and each did less than CORES_EFFICIENCY of
+ *    a thread's share of work: their cores are better left to others. If
+ *    the current threads are such a step themselves, back down to the
+ *    count below;
+ *  - down otherwise, by a quarter of the threads, to the fewest threads the
+ *    table, or failing that linear scaling, predicts still fit in the period.
+ *
+ * Linear scaling overestimates how much slower fewer threads are, so it never
+ * steps down below the target. The run starts on one thread and grows.
+ */
+
+#define CORES_WINDOW 4
+#define CORES_HEADROOM 0.9
+#define CORES_EFFICIENCY 0.5
+
+/* Weight of the last window in the table. */
+#define CORES_SMOOTHING 0.5
+
+typedef struct {
+  double period;
+  int max;
+  int active;
+  double *time;             // time per frame at every thread count, 0 if not tried
+
+  double last;              // end of the previous frame
+  double sum;               // of the frame times of the window
+  int n;                    // frames in the window
+
+  unsigned long frames;
+  unsigned long thread_frames;  // sum of the active threads over the frames
+  unsigned long slow;           // windows slower than the period
+} cores_t;
+
+static inline double
+cores_clock(void)
+{
+  struct timespec now;
+
+  DIE(clock_gettime(CLOCK_MONOTONIC, &now) == -1, "clock_gettime");
+
+  return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+static inline void
+cores_init(cores_t *c, const double fps, const int max)
+{
+  *c = (cores_t) {
+    .period = 1.0 / fps,
+    .max = max,
+    .active = 1,
+    .last = cores_clock(),
+  };
+
+  c->time = calloc(max + 1, sizeof(double));
+  DIE(c->time == NULL, "calloc");
+}
+
+static inline void
+cores_free(cores_t *c)
+{
+  free(c->time);
+}
+
+/*
+ * Work done by each of the threads from a to b, relative to a single thread
+ * of a, from the times in the table: 1 for perfect scaling, 0 if they did
+ * not help at all.
+ */
+static inline double
+cores_marginal_efficiency(const cores_t *c, const int a, const int b)
+{
+  return (c->time[a] / c->time[b] - 1) / ((double) b / a - 1);
+}
+
+/*
+ * Time per frame at n threads: measured if it was tried, otherwise scaled
+ * linearly from the current count.
+ */
+static inline double
+cores_predict(const cores_t *c, const int n)
+{
+  return c->time[n] > 0 ? c->time[n] : c->time[c->active] * c->active / n;
+}
+
+/*
+ * Account for a frame that has just been output. Returns the number of
+ * threads for the next one.
+ */
+static inline int
+cores_frame(cores_t *c)
+{
+  const double now = cores_clock();
+  const int n = c->active;
+  double t;
+  int next;
+
+  c->sum += now - c->last;
+  c->last = now;
+  c->n++;
+  c->frames++;
+  c->thread_frames += n;
+
+  if (c->n < CORES_WINDOW)
+    return n;
+
+  t = c->sum / c->n;
+  c->sum = 0;
+  c->n = 0;
+
+  c->time[n] = c->time[n] > 0 ? (1 - CORES_SMOOTHING) * c->time[n] + CORES_SMOOTHING * t : t;
+
+  if (t > CORES_HEADROOM * c->period) {
+    c->slow++;
+
+    /* Give back the threads of the last step up if they did not pay. */
+    for (next = n - 1; next > 0 && c->time[next] == 0; next--)
+      ;
+    if (next > 0 && cores_marginal_efficiency(c, next, n) < CORES_EFFICIENCY) {
+      c->active = next;
+      return next;
+    }
+
+    next = n + (n / 2 > 1 ? n / 2 : 1);
+    if (next > c->max)
+      next = c->max;
+
+    if (next > n && (c->time[next] == 0 ||
+                     cores_marginal_efficiency(c, n, next) >= CORES_EFFICIENCY))
+      c->active = next;
+  } else {
+    const int step = n / 4 > 1 ? n / 4 : 1;
+
+    for (next = n; next > 1 && next > n - step; next--) {
+      if (cores_predict(c, next - 1) > CORES_HEADROOM * c->period)
+        break;
+    }
+
+    c->active = next;
+  }
+
+  return c->active;
+}
+
+/*
+ * Print the threads used on average and the time per frame at every thread
+ * count tried.
+ */
+static inline void
+cores_report(const cores_t *c, FILE *f, const char *tag)
+{
+  int n;
+
+  fprintf(f, "%sMean threads: %.2lf of %d, %lu of %lu windows too slow\n", tag,
+          c->frames ? (double) c->thread_frames / c->frames : 0, c->max, c->slow,
+          c->frames / CORES_WINDOW);
+
+  for (n = 1; n <= c->max; n++) {
+    if (c->time[n] > 0)
+      fprintf(f, "%sTime per frame at %d threads: %lf\n", tag, n, c->time[n]);
+  }
+}
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "utils.h"
+
+/*
+ * Real-time deadline mode.
+ *
+ * Frames arrive one period apart, as from a live source at the target frame
+ * rate, and frame i must be out by the time frame i + 1 arrives. A video file
+ * is paced to match: the driver holds every decoded frame until its arrival
+ * time.
+ *
+ * After every frame, the controller compares the time the frame took, from
+ * arrival (or from the end of the previous frame, if that was later) to
+ * output, with the period. Above DEADLINE_HIGH of the period it escalates one step:
+ * first more threads, doubling up to the maximum, then cheaper levels of
+ * detection:
+ *
+ *   0  full resolution
+ *   1  edges of the frame downscaled by 2
+ *   2  edges of the frame downscaled by 4
+ *   3  as 2, but every other frame reuses the previous edges
+ *
+ * It steps back in the opposite order, better levels first, then fewer
+ * threads, once the load predicted for the step has stayed under
+ * DEADLINE_TARGET for DEADLINE_CALM frames, so that it does not undo a step
+ * only to miss the next deadline.
+ */
+
+#define DEADLINE_LEVELS 4
+#define DEADLINE_SKIP 3
+
+#define DEADLINE_HIGH 0.9
+#define DEADLINE_TARGET 0.7
+#define DEADLINE_CALM 8
+
+/* Weight of the last frame in the smoothed load. */
+#define DEADLINE_SMOOTHING 0.25
+
+typedef struct {
+  double period;
+  double origin;            // arrival of the first frame, 0 until then
+  double began;             // start of the frame in flight
+  long frame;               // index of the frame in flight
+
+  int threads;
+  int max_threads;
+  int level;
+  int calm;                 // frames the next step back has looked safe
+  double load;              // smoothed time per frame, in periods
+
+  unsigned long frames;
+  unsigned long misses;
+  double worst;             // latest output, past its deadline
+  unsigned long at_level[DEADLINE_LEVELS];
+} deadline_t;
+
+static inline double
+deadline_clock(void)
+{
+  struct timespec now;
+
+  DIE(clock_gettime(CLOCK_MONOTONIC, &now) == -1, "clock_gettime");
+
+  return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+static inline void
+deadline_init(deadline_t *d, const double fps, const int max_threads)
+{
+  *d = (deadline_t) {
+    .period = 1.0 / fps,
+    .threads = 1,
+    .max_threads = max_threads,
+  };
+}
+
+/*
+ * Wait for the arrival time of the next frame, once it is decoded.
+ */
+static inline void
+deadline_wait(deadline_t *d)
+{
+  const double now = deadline_clock();
+  double arrival;
+  struct timespec until;
+
+  if (d->origin == 0)
+    d->origin = now;
+
+  arrival = d->origin + d->frame * d->period;
+
+  if (arrival > now) {
+    until.tv_sec = (time_t) arrival;
+    until.tv_nsec = (long) ((arrival - until.tv_sec) * 1000000000.0);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+      ;
+  }
+
+  d->began = arrival > now ? arrival : now;
+}
+
+/* Downscaling factor of the current level. */
+static inline int
+deadline_preview(const deadline_t *d)
+{
+  return d->level == 0 ? 1 : d->level == 1 ? 2 : 4;
+}
+
+/* Whether the frame in flight reuses the previous edges. */
+static inline bool
+deadline_skip(const deadline_t *d)
+{
+  return d->level == DEADLINE_SKIP && d->frame % 2 == 1;
+}
+
+/*
+ * How much more a frame costs after stepping back: a level computes 4 times
+ * the pixels of the next one, or twice the frames from the skipping level,
+ * and one thread fewer spreads the same work over threads - 1.
+ */
+static inline double
+deadline_step_back_cost(const deadline_t *d)
+{
+  if (d->level == DEADLINE_SKIP)
+    return 2;
+  if (d->level > 0)
+    return 4;
+  return d->threads > 1 ? (double) d->threads / (d->threads - 1) : 0;
+}
+
+/*
+ * Account for the frame in flight, which has just been output, and pick the
+ * threads and level of the next one. Returns how late the frame was, 0 if
+ * it made its deadline.
+ */
+static inline double
+deadline_done(deadline_t *d)
+{
+  const double now = deadline_clock();
+  const double late = now - (d->origin + (d->frame + 1) * d->period);
+  const double load = (now - d->began) / d->period;
+  const double cost = deadline_step_back_cost(d);
+
+  /* The frames the skipping level does compute are quarter ones. */
+  if (deadline_skip(d))
+    d->at_level[DEADLINE_SKIP]++;
+  else
+    d->at_level[d->level == DEADLINE_SKIP ? DEADLINE_SKIP - 1 : d->level]++;
+
+  d->frames++;
+  d->frame++;
+
+  d->load = d->frames == 1 ? load : (1 - DEADLINE_SMOOTHING) * d->load + DEADLINE_SMOOTHING * load;
+
+  if (late > 0) {
+    d->misses++;
+    if (late > d->worst)
+      d->worst = late;
+  }
+
+  /*
+   * A late frame that took less than the high mark is the backlog of an
+   * earlier one draining, which the step taken then already deals with.
+   */
+  if (load > DEADLINE_HIGH) {
+    d->calm = 0;
+    d->load = load;
+
+    if (d->threads < d->max_threads)
+      d->threads = 2 * d->threads < d->max_threads ? 2 * d->threads : d->max_threads;
+    else if (d->level < DEADLINE_LEVELS - 1)
+      d->level++;
+  } else if (late <= 0 && cost > 0 && d->load * cost < DEADLINE_TARGET) {
+    if (++d->calm >= DEADLINE_CALM) {
+      d->calm = 0;
+      d->load *= cost;
+
+      if (d->level > 0)
+        d->level--;
+      else
+        d->threads--;
+    }
+  } else {
+    d->calm = 0;
+  }
+
+  return late > 0 ? late : 0;
+}
+
+/*
+ * Print the deadlines missed and the frames done at every level.
+ */
+static inline void
+deadline_report(const deadline_t *d, FILE *f, const char *tag)
+{
+  fprintf(f, "%sDeadline misses: %lu of %lu frames, worst %lf late\n",
+          tag, d->misses, d->frames, d->worst);
+  fprintf(f, "%sFrames per level: %lu full, %lu half, %lu quarter, %lu reused\n",
+          tag, d->at_level[0], d->at_level[1], d->at_level[2], d->at_level[3]);
+}
+
+#endif
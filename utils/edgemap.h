@@ -0,0 +1,289 @@
+#ifndef EDGEMAP_H
+#define EDGEMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+/*
+ * Compact binary edge-map files, an alternative to re-encoding the edges
+ * as video. Every pixel is stored as a single bit (1 = edge).
+ *
+ * File layout (integers are written in host byte order):
+ *   header  : "EDGM", u32 version, u32 width, u32 height,
+ *             u32 compression, u32 keyframe interval
+ *   frames  : u8 type, u32 payload size, payload
+ *   index   : u64 file offset of every frame record
+ *   trailer : u64 number of frames, u64 offset of the index, "EDGI"
+ *
+ * Frame types:
+ *   EDGEMAP_RAW   - width * height bits, LSB first
+ *   EDGEMAP_RLE   - varint run lengths, alternating between background and
+ *                   edge runs, starting with a (possibly empty) background run
+ *   EDGEMAP_DELTA - like EDGEMAP_RLE, but of the XOR against the previous frame
+ *
+ * A frame is stored raw whenever its compressed form would be larger. In
+ * delta mode every keyframe interval-th frame is a self-contained RLE frame,
+ * so that random access never has to decode more than one interval.
+ * Reading the files back is left to the tools that consume them.
+ */
+
+#define EDGEMAP_VERSION 1
+#define EDGEMAP_KEYFRAME_INTERVAL 30
+
+enum {
+  EDGEMAP_RAW = 0,
+  EDGEMAP_RLE = 1,
+  EDGEMAP_DELTA = 2,
+};
+
+typedef struct {
+  FILE *file;
+  int width;
+  int height;
+  int compression;
+  uint8_t *bits;      // packed current frame
+  uint8_t *prev;      // packed previous frame, delta mode only
+  uint8_t *payload;
+  uint64_t *index;
+  uint64_t nframes;
+  uint64_t capacity;
+} edgemap_t;
+
+/*
+ * Returns the EDGEMAP_* compression matching name, or -1 if unknown.
+ */
+static inline int
+edgemap_parse_compression(const char *name)
+{
+  if (strcmp(name, "none") == 0)
+    return EDGEMAP_RAW;
+  if (strcmp(name, "rle") == 0)
+    return EDGEMAP_RLE;
+  if (strcmp(name, "delta") == 0)
+    return EDGEMAP_DELTA;
+
+  return -1;
+}
+
+static inline size_t
+edgemap_packed_size(const int width, const int height)
+{
+  return ((size_t) width * height + 7) / 8;
+}
+
+static inline size_t
+edgemap_put_varint(uint8_t *dst, uint64_t v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    dst[n++] = (uint8_t) (v | 0x80);
+    v >>= 7;
+  }
+  dst[n++] = (uint8_t) v;
+
+  return n;
+}
+
+/*
+ * Run-length encode the packed bits (XOR-ed with ref, if not NULL) into dst.
+ * Stops and returns 0 as soon as the output would exceed limit bytes.
+ */
+static inline size_t
+edgemap_rle_encode(const uint8_t *bits,
+                   const uint8_t *ref,
+                   const size_t   npixels,
+                   uint8_t       *dst,
+                   const size_t   limit)
+{
+  const size_t nbytes = (npixels + 7) / 8;
+  uint64_t run = 0;
+  size_t size = 0;
+  size_t i;
+  int value = 0;
+  int k;
+
+  for (i = 0; i < nbytes; i++) {
+    uint8_t b = ref ? bits[i] ^ ref[i] : bits[i];
+
+    /* Whole bytes that continue the current run. */
+    if (b == (value ? 0xff : 0x00) && i < nbytes - 1) {
+      run += 8;
+      continue;
+    }
+
+    for (k = 0; k < 8 && i * 8 + k < npixels; k++) {
+      if (((b >> k) & 1) == value) {
+        run++;
+        continue;
+      }
+
+      if (size + 10 > limit)
+        return 0;
+      size += edgemap_put_varint(dst + size, run);
+      value = !value;
+      run = 1;
+    }
+  }
+
+  if (size + 10 > limit)
+    return 0;
+  size += edgemap_put_varint(dst + size, run);
+
+  return size;
+}
+
+static inline void
+edgemap_write_header(edgemap_t *em)
+{
+  const uint32_t header[] = {EDGEMAP_VERSION, em->width, em->height,
+                             em->compression, EDGEMAP_KEYFRAME_INTERVAL};
+
+  DIE(fwrite("EDGM", 1, 4, em->file) != 4, "fwrite");
+  DIE(fwrite(header, sizeof(header), 1, em->file) != 1, "fwrite");
+}
+
+/*
+ * Create an edge-map file. The frame size is taken from the first frame.
+ */
+static inline edgemap_t *
+edgemap_create(const char *path, const int compression)
+{
+  edgemap_t *em = calloc(1, sizeof(edgemap_t));
+  DIE(em == NULL, "calloc");
+
+  em->file = fopen(path, "wb");
+  DIE(em->file == NULL, "fopen");
+
+  em->compression = compression;
+
+  return em;
+}
+
+/*
+ * Append a frame of width * height bytes, where any non-zero byte is an edge.
+ */
+static inline void
+edgemap_write_frame(edgemap_t     *em,
+                    const uint8_t *edges,
+                    const int      width,
+                    const int      height)
+{
+  const size_t npixels = (size_t) width * height;
+  const size_t nbytes = edgemap_packed_size(width, height);
+  const uint8_t *payload;
+  uint8_t *tmp;
+  uint8_t type = EDGEMAP_RAW;
+  uint32_t size = nbytes;
+  size_t i, k;
+  long offset;
+
+  if (em->bits == NULL) {
+    em->width = width;
+    em->height = height;
+    edgemap_write_header(em);
+
+    em->bits = calloc(nbytes, 1);
+    DIE(em->bits == NULL, "calloc");
+
+    em->prev = calloc(nbytes, 1);
+    DIE(em->prev == NULL, "calloc");
+
+    em->payload = malloc(nbytes);
+    DIE(em->payload == NULL, "malloc");
+  }
+
+  DIE(width != em->width || height != em->height, "edgemap frame size");
+
+  /* Pack eight pixels per byte. */
+  for (i = 0; i < npixels / 8; i++) {
+    uint8_t b = 0;
+
+    for (k = 0; k < 8; k++)
+      b |= (edges[i * 8 + k] != 0) << k;
+    em->bits[i] = b;
+  }
+  if (npixels % 8) {
+    em->bits[i] = 0;
+    for (k = 0; i * 8 + k < npixels; k++)
+      em->bits[i] |= (edges[i * 8 + k] != 0) << k;
+  }
+
+  payload = em->bits;
+
+  if (em->compression == EDGEMAP_DELTA && em->nframes % EDGEMAP_KEYFRAME_INTERVAL != 0) {
+    size_t n = edgemap_rle_encode(em->bits, em->prev, npixels, em->payload, nbytes);
+
+    if (n > 0) {
+      type = EDGEMAP_DELTA;
+      size = n;
+      payload = em->payload;
+    }
+  } else if (em->compression != EDGEMAP_RAW) {
+    size_t n = edgemap_rle_encode(em->bits, NULL, npixels, em->payload, nbytes);
+
+    if (n > 0) {
+      type = EDGEMAP_RLE;
+      size = n;
+      payload = em->payload;
+    }
+  }
+
+  if (em->nframes == em->capacity) {
+    em->capacity = em->capacity ? em->capacity * 2 : 256;
+    em->index = realloc(em->index, em->capacity * sizeof(uint64_t));
+    DIE(em->index == NULL, "realloc");
+  }
+
+  offset = ftell(em->file);
+  DIE(offset < 0, "ftell");
+  em->index[em->nframes++] = offset;
+
+  DIE(fwrite(&type, 1, 1, em->file) != 1, "fwrite");
+  DIE(fwrite(&size, sizeof(size), 1, em->file) != 1, "fwrite");
+  DIE(fwrite(payload, 1, size, em->file) != size, "fwrite");
+
+  /* Keep the current frame around as the reference for the next delta. */
+  tmp = em->prev;
+  em->prev = em->bits;
+  em->bits = tmp;
+}
+
+/*
+ * Write the frame index and trailer, then release the writer.
+ */
+static inline void
+edgemap_close(edgemap_t *em)
+{
+  long offset;
+  uint64_t trailer[2];
+
+  if (em->bits == NULL) {
+    em->width = em->height = 0;
+    edgemap_write_header(em);
+  }
+
+  offset = ftell(em->file);
+  DIE(offset < 0, "ftell");
+
+  DIE(fwrite(em->index, sizeof(uint64_t), em->nframes, em->file) != em->nframes, "fwrite");
+
+  trailer[0] = em->nframes;
+  trailer[1] = offset;
+  DIE(fwrite(trailer, sizeof(trailer), 1, em->file) != 1, "fwrite");
+  DIE(fwrite("EDGI", 1, 4, em->file) != 4, "fwrite");
+
+  DIE(fclose(em->file) != 0, "fclose");
+
+  free(em->bits);
+  free(em->prev);
+  free(em->payload);
+  free(em->index);
+  free(em);
+}
+
+#endif
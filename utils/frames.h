@@ -0,0 +1,80 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * Frame selection: only the frames START, START + STRIDE, ... before END of
+ * a video are processed, and decoding stops at END, so that a job over a
+ * window of a long video costs in proportion to where the window ends
+ * rather than to the whole file. Frames are numbered from 0 in decoding
+ * order. The frames before START still have to be decoded, since libde can
+ * only read a video from its start.
+ */
+
+typedef struct {
+  long start;
+  long end;                 // -1 for the end of the video
+  long stride;
+} frames_t;
+
+#define FRAMES_ALL ((frames_t) {0, -1, 1})
+
+/*
+ * Parse START:END[:STRIDE], where START and END may be left out, e.g.
+ * "100:200", ":500:5" or "::10". Returns 0 on success, -1 if spec is
+ * malformed.
+ */
+static inline int
+frames_parse(frames_t *f, const char *spec)
+{
+  const char *p = spec;
+  char *end;
+
+  *f = FRAMES_ALL;
+
+  if (*p != ':') {
+    f->start = strtol(p, &end, 10);
+    if (end == p || f->start < 0)
+      return -1;
+    p = end;
+  }
+
+  if (*p++ != ':')
+    return -1;
+
+  if (*p && *p != ':') {
+    f->end = strtol(p, &end, 10);
+    if (end == p || f->end <= f->start)
+      return -1;
+    p = end;
+  }
+
+  if (*p == ':') {
+    p++;
+    f->stride = strtol(p, &end, 10);
+    if (end == p || f->stride < 1)
+      return -1;
+    p = end;
+  }
+
+  return *p ? -1 : 0;
+}
+
+static inline bool
+frames_selected(const frames_t *f, const long i)
+{
+  return i >= f->start && (f->end < 0 || i < f->end) && (i - f->start) % f->stride == 0;
+}
+
+/*
+ * Whether no frame from the i-th on is selected, so decoding can stop.
+ */
+static inline bool
+frames_done(const frames_t *f, const long i)
+{
+  return f->end >= 0 && i >= f->end;
+}
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef HYSTERESIS_H
+#define HYSTERESIS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+/*
+ * Bit-packed hysteresis.
+ *
+ * Non-maximum suppression classifies every pixel directly into two bit
+ * planes: weak (magnitude >= T1) and edges, which starts with the strong
+ * pixels (magnitude >= T2) and ends up holding the result. Every row starts
+ * on a 64-bit word boundary.
+ *
+ * Edges then grow into the weak pixels until nothing changes. Within a row,
+ * a Kogge-Stone prefix spreads an edge along a run of weak pixels in 6 steps
+ * per word; across rows, the edges of the rows above and below are dilated by
+ * one pixel and masked with the weak pixels. Passes alternate top-down and
+ * bottom-up, and most frames converge in two or three. The fixed point is the
+ * set of weak pixels 8-connected to a strong one, exactly what the stack
+ * based tracer finds, at 2 bits per pixel instead of about 10 bytes.
+ *
+ * Like the tracer, whose seed counter stops at (width - 2) * (height - 2),
+ * only strong pixels up to that linear index start an edge.
+ */
+
+#define HYSTERESIS_MAX_BRIGHTNESS 255
+
+typedef struct {
+  int width;
+  int height;
+  int words;            // 64-bit words per row
+  size_t seed_limit;    // last linear index that may start an edge
+  uint64_t *weak;
+  uint64_t *edges;
+  uint64_t *row;        // scratch row
+} hysteresis_t;
+
+static inline hysteresis_t *
+hysteresis_create(const int width, const int height)
+{
+  hysteresis_t *hy = malloc(sizeof(hysteresis_t));
+  DIE(hy == NULL, "malloc");
+
+  hy->width = width;
+  hy->height = height;
+  hy->words = (width + 63) / 64;
+  hy->seed_limit = (size_t) (width - 2) * (height - 2);
+
+  hy->weak = calloc((size_t) hy->words * height, sizeof(uint64_t));
+  DIE(hy->weak == NULL, "calloc");
+
+  hy->edges = calloc((size_t) hy->words * height, sizeof(uint64_t));
+  DIE(hy->edges == NULL, "calloc");
+
+  hy->row = malloc(hy->words * sizeof(uint64_t));
+  DIE(hy->row == NULL, "malloc");
+
+  return hy;
+}
+
+static inline void
+hysteresis_free(hysteresis_t *hy)
+{
+  free(hy->weak);
+  free(hy->edges);
+  free(hy->row);
+  free(hy);
+}
+
+static inline void
+hysteresis_clear(hysteresis_t *hy)
+{
+  memset(hy->weak, 0, (size_t) hy->words * hy->height * sizeof(uint64_t));
+  memset(hy->edges, 0, (size_t) hy->words * hy->height * sizeof(uint64_t));
+}
+
+/*
+ * Classify the pixel (x, y) whose suppressed magnitude is nms. Rows may be
+ * classified concurrently, but each row by a single thread.
+ */
+static inline void
+hysteresis_mark(hysteresis_t *hy,
+                const int     x,
+                const int     y,
+                const int     nms,
+                const int     t1,
+                const int     t2)
+{
+  const size_t word = (size_t) y * hy->words + x / 64;
+  const uint64_t bit = 1ull << (x % 64);
+
+  if (nms >= t1)
+    hy->weak[word] |= bit;
+  if (nms >= t2 && (size_t) y * hy->width + x <= hy->seed_limit)
+    hy->edges[word] |= bit;
+}
+
+/*
+ * Whether linear index p lies off the one-pixel frame border, the only
+ * pixels that can be weak. The stack based tracers only follow neighbours
+ * that do, so that they stay in the frame whatever the lower threshold.
+ */
+static inline bool
+hysteresis_interior(const int p, const int width, const int height)
+{
+  const int x = p % width;
+
+  return x > 0 && x < width - 1 && p >= width && p < (height - 1) * width;
+}
+
+/*
+ * Classify the interior of a whole frame of suppressed magnitudes.
+ */
+static inline void
+hysteresis_classify(hysteresis_t *hy,
+                    const short  *nms,
+                    const int     t1,
+                    const int     t2)
+{
+  int x, y;
+
+  hysteresis_clear(hy);
+
+  for (y = 1; y < hy->height - 1; y++)
+    for (x = 1; x < hy->width - 1; x++)
+      hysteresis_mark(hy, x, y, nms[y * hy->width + x], t1, t2);
+}
+
+/*
+ * Spread the edges of a row along its runs of weak pixels, both ways.
+ * Returns true if any pixel was added.
+ */
+static inline bool
+hysteresis_fill_row(uint64_t *e, const uint64_t *w, const int words)
+{
+  uint64_t g, p, carry = 0;
+  bool changed = false;
+  int k;
+
+  for (k = 0; k < words; k++) {
+    g = e[k] | (w[k] & carry);
+    p = w[k];
+    g |= p & (g << 1);  p &= p << 1;
+    g |= p & (g << 2);  p &= p << 2;
+    g |= p & (g << 4);  p &= p << 4;
+    g |= p & (g << 8);  p &= p << 8;
+    g |= p & (g << 16); p &= p << 16;
+    g |= p & (g << 32);
+    changed |= g != e[k];
+    e[k] = g;
+    carry = g >> 63;
+  }
+
+  carry = 0;
+  for (k = words - 1; k >= 0; k--) {
+    g = e[k] | (w[k] & carry);
+    p = w[k];
+    g |= p & (g >> 1);  p &= p >> 1;
+    g |= p & (g >> 2);  p &= p >> 2;
+    g |= p & (g >> 4);  p &= p >> 4;
+    g |= p & (g >> 8);  p &= p >> 8;
+    g |= p & (g >> 16); p &= p >> 16;
+    g |= p & (g >> 32);
+    changed |= g != e[k];
+    e[k] = g;
+    carry = g << 63;
+  }
+
+  return changed;
+}
+
+/*
+ * Grow row y from its neighbouring rows and along itself. Returns true if
+ * it changed.
+ */
+static inline bool
+hysteresis_grow_row(hysteresis_t *hy, const int y)
+{
+  const int words = hy->words;
+  uint64_t *e = hy->edges + (size_t) y * words;
+  const uint64_t *w = hy->weak + (size_t) y * words;
+  const uint64_t *above = e - words;
+  const uint64_t *below = e + words;
+  uint64_t *n = hy->row;
+  bool changed = false;
+  int k;
+
+  for (k = 0; k < words; k++)
+    n[k] = above[k] | below[k];
+
+  /* Dilate by one pixel to reach the diagonal neighbours. */
+  for (k = 0; k < words; k++) {
+    const uint64_t left = k > 0 ? n[k - 1] >> 63 : 0;
+    const uint64_t right = k < words - 1 ? n[k + 1] << 63 : 0;
+    const uint64_t grown = e[k] | ((n[k] | (n[k] << 1) | left | (n[k] >> 1) | right) & w[k]);
+
+    changed |= grown != e[k];
+    e[k] = grown;
+  }
+
+  return hysteresis_fill_row(e, w, words) || changed;
+}
+
+/*
+ * Grow the edges until they stop changing.
+ */
+static inline void
+hysteresis_run(hysteresis_t *hy)
+{
+  bool changed = true;
+  int y;
+
+  /* Rows 0 and height - 1 hold no weak pixels, so they never change. */
+  while (changed) {
+    changed = false;
+
+    for (y = 1; y < hy->height - 1; y++)
+      changed |= hysteresis_grow_row(hy, y);
+
+    for (y = hy->height - 2; y >= 1; y--)
+      changed |= hysteresis_grow_row(hy, y);
+  }
+}
+
+/*
+ * Load row y from width bytes that are 0, any other value for a weak pixel
+ * or HYSTERESIS_MAX_BRIGHTNESS for an edge, e.g. written by
+ * hysteresis_store_row() into an image too large for the bit planes.
+ */
+static inline void
+hysteresis_load_row(hysteresis_t *hy, const int y, const uint8_t *row)
+{
+  uint64_t *w = hy->weak + (size_t) y * hy->words;
+  uint64_t *e = hy->edges + (size_t) y * hy->words;
+  int x;
+
+  memset(w, 0, hy->words * sizeof(uint64_t));
+  memset(e, 0, hy->words * sizeof(uint64_t));
+
+  for (x = 0; x < hy->width; x++) {
+    if (row[x])
+      w[x / 64] |= 1ull << (x % 64);
+    if (row[x] == HYSTERESIS_MAX_BRIGHTNESS)
+      e[x / 64] |= 1ull << (x % 64);
+  }
+}
+
+/*
+ * Mark the edges of row y as HYSTERESIS_MAX_BRIGHTNESS in row, leaving the
+ * other bytes alone. Returns true if any byte changed.
+ */
+static inline bool
+hysteresis_store_row(const hysteresis_t *hy, const int y, uint8_t *row)
+{
+  const uint64_t *e = hy->edges + (size_t) y * hy->words;
+  bool changed = false;
+  int x;
+
+  for (x = 0; x < hy->width; x++) {
+    if ((e[x / 64] >> (x % 64)) & 1 && row[x] != HYSTERESIS_MAX_BRIGHTNESS) {
+      row[x] = HYSTERESIS_MAX_BRIGHTNESS;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+/*
+ * Write the edges as width * height bytes of 0 or HYSTERESIS_MAX_BRIGHTNESS.
+ */
+static inline void
+hysteresis_output(const hysteresis_t *hy, uint8_t *out)
+{
+  int x, y;
+
+  for (y = 0; y < hy->height; y++) {
+    const uint64_t *e = hy->edges + (size_t) y * hy->words;
+
+    for (x = 0; x < hy->width; x++)
+      out[y * hy->width + x] = (e[x / 64] >> (x % 64)) & 1 ? HYSTERESIS_MAX_BRIGHTNESS : 0;
+  }
+}
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef IIR_H
+#define IIR_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+/*
+ * Recursive Gaussian filter (Young and van Vliet, "Recursive implementation
+ * of the Gaussian filter", Signal Processing 44, 1995).
+ *
+ * Each dimension is filtered by a third-order causal pass followed by an
+ * anti-causal one, so the cost is 14 multiply-adds per pixel whatever sigma
+ * is, against n * n for the n x n kernel of gaussian_filter(). The result
+ * approximates the sampled Gaussian to within a few percent, which is
+ * plenty for a pre-Canny blur. Both borders are extended by replicating the
+ * edge pixel, so unlike convolution() the whole image gets a value.
+ *
+ * Rows are filtered independently. Columns are filtered in strips of
+ * IIR_STRIP columns that advance together row by row, so the memory accesses
+ * stay sequential and the strips can run in parallel.
+ */
+
+#define IIR_STRIP 64
+#define IIR_MAX_BRIGHTNESS 255
+
+#ifdef _OPENMP
+#define IIR_PARALLEL_FOR \
+  _Pragma("omp parallel for num_threads(nthreads)")
+#else
+#define IIR_PARALLEL_FOR
+#endif
+
+/*
+ * Coefficients for the given sigma (valid from 0.5 up): B is the input gain
+ * and b[0..2] weigh the three previous outputs.
+ */
+static inline void
+iir_coefficients(const float sigma, float *B, float b[3])
+{
+  const float q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                               : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+  const float q2 = q * q;
+  const float q3 = q2 * q;
+  const float b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+
+  b[0] = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+  b[1] = -(1.4281 * q2 + 1.26661 * q3) / b0;
+  b[2] = 0.422205 * q3 / b0;
+  *B = 1 - (b[0] + b[1] + b[2]);
+}
+
+/*
+ * Blur the 8-bit in (nx x ny) into out, mapping the result to the same range
+ * as convolution() does with normalize set.
+ */
+static inline void
+iir_gaussian(const uint8_t *in,
+             short int     *out,
+             const int      nx,
+             const int      ny,
+             const float    sigma,
+             const int      nthreads)
+{
+  const float min = 0.5;
+  const float max = 254.5;
+  float B, b[3];
+
+  float *tmp = malloc((size_t) nx * ny * sizeof(float));
+  DIE(tmp == NULL, "malloc");
+
+  iir_coefficients(sigma, &B, b);
+  (void) nthreads;
+
+  /* Rows. */
+  IIR_PARALLEL_FOR
+  for (int y = 0; y < ny; y++) {
+    const uint8_t *src = in + (size_t) y * nx;
+    float *row = tmp + (size_t) y * nx;
+    float w1, w2, w3, w;
+    int x;
+
+    w1 = w2 = w3 = src[0];
+    for (x = 0; x < nx; x++) {
+      w = B * src[x] + b[0] * w1 + b[1] * w2 + b[2] * w3;
+      row[x] = w;
+      w3 = w2;
+      w2 = w1;
+      w1 = w;
+    }
+
+    w1 = w2 = w3 = row[nx - 1];
+    for (x = nx - 1; x >= 0; x--) {
+      w = B * row[x] + b[0] * w1 + b[1] * w2 + b[2] * w3;
+      row[x] = w;
+      w3 = w2;
+      w2 = w1;
+      w1 = w;
+    }
+  }
+
+  /* Columns, one strip at a time. */
+  IIR_PARALLEL_FOR
+  for (int x0 = 0; x0 < nx; x0 += IIR_STRIP) {
+    const int n = nx - x0 < IIR_STRIP ? nx - x0 : IIR_STRIP;
+    float w1[IIR_STRIP], w2[IIR_STRIP], w3[IIR_STRIP];
+    int x, y;
+
+    for (x = 0; x < n; x++)
+      w1[x] = w2[x] = w3[x] = tmp[x0 + x];
+
+    for (y = 0; y < ny; y++) {
+      float *row = tmp + (size_t) y * nx + x0;
+
+      for (x = 0; x < n; x++) {
+        const float w = B * row[x] + b[0] * w1[x] + b[1] * w2[x] + b[2] * w3[x];
+        row[x] = w;
+        w3[x] = w2[x];
+        w2[x] = w1[x];
+        w1[x] = w;
+      }
+    }
+
+    for (x = 0; x < n; x++)
+      w1[x] = w2[x] = w3[x] = tmp[(size_t) (ny - 1) * nx + x0 + x];
+
+    for (y = ny - 1; y >= 0; y--) {
+      float *row = tmp + (size_t) y * nx + x0;
+      short int *dst = out + (size_t) y * nx + x0;
+
+      for (x = 0; x < n; x++) {
+        const float w = B * row[x] + b[0] * w1[x] + b[1] * w2[x] + b[2] * w3[x];
+        w3[x] = w2[x];
+        w2[x] = w1[x];
+        w1[x] = w;
+        dst[x] = (short int) (IIR_MAX_BRIGHTNESS * (w - min) / (max - min));
+      }
+    }
+  }
+
+  free(tmp);
+}
+
+#endif
@@ -0,0 +1,600 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hysteresis.h"
+#include "kernels.h"
+#include "roi.h"
+#include "utils.h"
+
+/*
+ * Temporal incremental Canny edge detection.
+ *
+ * Static camera footage changes little from one frame to the next, so the
+ * luma of every frame is compared with the previous one in tiles of
+ * INCREMENTAL_TILE x INCREMENTAL_TILE pixels. The blur, Sobel, gradient
+ * magnitude and non-maximum suppression stages are only recomputed in the
+ * part of each tile that a changed tile can reach, and hysteresis is only
+ * re-resolved for the edges touching the recomputed area. Everything else is
+ * reused from the previous frame.
+ *
+ * Every stage does exactly the same arithmetic as canny_edge_detection(), so
+ * the output is identical to recomputing the whole frame. That includes the
+ * frame border: the kn / 2 pixels the blur cannot reach stay 0 here, as in
+ * the zeroed blur buffer of every backend, and Sobel reads them the same way
+ * near the border. Tiles can also be
+ * declared unchanged up front (e.g. from the decoder's motion vectors), which
+ * skips comparing them but gives up that guarantee.
+ *
+ * With a region of interest, non-maximum suppression only runs on the tiles
+ * in it, so no edge can appear anywhere else, and the earlier stages only
+ * run as far out as the region's halo needs. Tiles too far from the region
+ * to reach it are not even compared. Invalidating before every frame turns
+ * this into plain Canny restricted to the region.
+ */
+
+#define INCREMENTAL_TILE 32
+#define INCREMENTAL_MAX_BRIGHTNESS 255
+
+#ifdef _OPENMP
+#define INCREMENTAL_PARALLEL_FOR \
+  _Pragma("omp parallel for schedule(dynamic) num_threads(inc->nthreads)")
+#else
+#define INCREMENTAL_PARALLEL_FOR
+#endif
+
+/* Stages, in the order they are computed. */
+enum {
+  INC_BLUR,
+  INC_GRADIENT,
+  INC_NMS,
+  INC_STAGES,
+};
+
+/* Half-open rectangle [x0, x1) x [y0, y1), empty if x0 >= x1. */
+typedef struct {
+  int x0, y0, x1, y1;
+} inc_rect_t;
+
+typedef struct {
+  int width;
+  int height;
+  int nthreads;
+  int ntx, nty;             // tiles per row and column
+
+  int kn;                   // Gaussian kernel size
+  float *kernel;
+
+  uint8_t *prev;            // luma of the previous frame
+  int16_t *blur;
+  int16_t *after_Gx;
+  int16_t *after_Gy;
+  int16_t *G;
+  int16_t *nms;
+  uint8_t *out;
+
+  uint8_t *dirty;           // per tile, luma changed since the previous frame
+  uint8_t *clean;           // per tile, caller asserts the luma did not change
+  uint8_t *roi;             // per tile, in the region of interest; NULL for all
+  uint8_t *reach;           // per tile, in the region or next to it
+  inc_rect_t *rects[INC_STAGES];
+  int *stack;
+  int *cleared;
+  int primed;               // prev, nms and out hold a previous frame
+
+  uint64_t tiles_total;
+  uint64_t tiles_dirty;
+} incremental_t;
+
+static inline incremental_t *
+incremental_create(const int   width,
+                   const int   height,
+                   const float sigma,
+                   const int   nthreads)
+{
+  const size_t size = (size_t) width * height;
+  const int n = 2 * (int) (2 * sigma) + 3;
+  const float mean = (float) floor(n / 2.0);
+  size_t c = 0;
+  int i, j;
+
+  incremental_t *inc = calloc(1, sizeof(incremental_t));
+  DIE(inc == NULL, "calloc");
+
+  inc->width = width;
+  inc->height = height;
+  inc->nthreads = nthreads;
+  inc->ntx = (width + INCREMENTAL_TILE - 1) / INCREMENTAL_TILE;
+  inc->nty = (height + INCREMENTAL_TILE - 1) / INCREMENTAL_TILE;
+
+  /* Same kernel as gaussian_filter(). */
+  inc->kn = n;
+  inc->kernel = malloc(n * n * sizeof(float));
+  DIE(inc->kernel == NULL, "malloc");
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++)
+      inc->kernel[c++] = exp(-0.5 * (pow((i - mean) / sigma, 2.0) + pow((j - mean) / sigma, 2.0))) / (2 * M_PI * sigma * sigma);
+  }
+
+  inc->prev = calloc(size, sizeof(uint8_t));
+  DIE(inc->prev == NULL, "calloc");
+
+  /* Its border is never written, and must stay 0 like the backends'. */
+  inc->blur = calloc(size, sizeof(int16_t));
+  DIE(inc->blur == NULL, "calloc");
+
+  inc->after_Gx = calloc(size, sizeof(int16_t));
+  DIE(inc->after_Gx == NULL, "calloc");
+
+  inc->after_Gy = calloc(size, sizeof(int16_t));
+  DIE(inc->after_Gy == NULL, "calloc");
+
+  inc->G = calloc(size, sizeof(int16_t));
+  DIE(inc->G == NULL, "calloc");
+
+  inc->nms = calloc(size, sizeof(int16_t));
+  DIE(inc->nms == NULL, "calloc");
+
+  inc->out = calloc(size, sizeof(uint8_t));
+  DIE(inc->out == NULL, "calloc");
+
+  inc->dirty = calloc(inc->ntx * inc->nty, sizeof(uint8_t));
+  DIE(inc->dirty == NULL, "calloc");
+
+  inc->clean = calloc(inc->ntx * inc->nty, sizeof(uint8_t));
+  DIE(inc->clean == NULL, "calloc");
+
+  for (i = 0; i < INC_STAGES; i++) {
+    inc->rects[i] = calloc(inc->ntx * inc->nty, sizeof(inc_rect_t));
+    DIE(inc->rects[i] == NULL, "calloc");
+  }
+
+  inc->stack = malloc(size * sizeof(int));
+  DIE(inc->stack == NULL, "malloc");
+
+  inc->cleared = malloc(size * sizeof(int));
+  DIE(inc->cleared == NULL, "malloc");
+
+  return inc;
+}
+
+static inline void
+incremental_free(incremental_t *inc)
+{
+  int i;
+
+  for (i = 0; i < INC_STAGES; i++)
+    free(inc->rects[i]);
+
+  free(inc->kernel);
+  free(inc->prev);
+  free(inc->blur);
+  free(inc->after_Gx);
+  free(inc->after_Gy);
+  free(inc->G);
+  free(inc->nms);
+  free(inc->out);
+  free(inc->dirty);
+  free(inc->clean);
+  free(inc->roi);
+  free(inc->reach);
+  free(inc->stack);
+  free(inc->cleared);
+  free(inc);
+}
+
+/*
+ * Restrict edge detection to a region of interest.
+ */
+static inline void
+incremental_set_roi(incremental_t *inc, const roi_t *roi)
+{
+  const int ntiles = inc->ntx * inc->nty;
+  int tx, ty, nx, ny;
+
+  inc->roi = malloc(ntiles);
+  DIE(inc->roi == NULL, "malloc");
+
+  inc->reach = calloc(ntiles, sizeof(uint8_t));
+  DIE(inc->reach == NULL, "calloc");
+
+  roi_tiles(roi, inc->width, inc->height, INCREMENTAL_TILE, inc->roi);
+
+  /* Same neighbourhood as incremental_plan(). */
+  for (ty = 0; ty < inc->nty; ty++) {
+    for (tx = 0; tx < inc->ntx; tx++) {
+      if (!inc->roi[ty * inc->ntx + tx])
+        continue;
+
+      for (ny = ty - 1; ny <= ty + 1; ny++)
+        for (nx = tx - 1; nx <= tx + 1; nx++)
+          if (nx >= 0 && ny >= 0 && nx < inc->ntx && ny < inc->nty)
+            inc->reach[ny * inc->ntx + nx] = 1;
+    }
+  }
+
+  inc->primed = 0;
+}
+
+/*
+ * Forget the previous frame, so that the next one is computed in full.
+ */
+static inline void
+incremental_invalidate(incremental_t *inc)
+{
+  inc->primed = 0;
+}
+
+static inline inc_rect_t
+incremental_tile_rect(const incremental_t *inc, const int tx, const int ty)
+{
+  inc_rect_t r;
+
+  r.x0 = tx * INCREMENTAL_TILE;
+  r.y0 = ty * INCREMENTAL_TILE;
+  r.x1 = r.x0 + INCREMENTAL_TILE < inc->width ? r.x0 + INCREMENTAL_TILE : inc->width;
+  r.y1 = r.y0 + INCREMENTAL_TILE < inc->height ? r.y0 + INCREMENTAL_TILE : inc->height;
+
+  return r;
+}
+
+/*
+ * Grow bbox to cover (r expanded by e) clipped to clip.
+ */
+static inline void
+incremental_rect_merge(inc_rect_t       *bbox,
+                       const inc_rect_t  r,
+                       const int         e,
+                       const inc_rect_t  clip)
+{
+  const int x0 = r.x0 - e > clip.x0 ? r.x0 - e : clip.x0;
+  const int y0 = r.y0 - e > clip.y0 ? r.y0 - e : clip.y0;
+  const int x1 = r.x1 + e < clip.x1 ? r.x1 + e : clip.x1;
+  const int y1 = r.y1 + e < clip.y1 ? r.y1 + e : clip.y1;
+
+  if (r.x0 >= r.x1 || x0 >= x1 || y0 >= y1)
+    return;
+
+  if (bbox->x0 >= bbox->x1) {
+    bbox->x0 = x0;
+    bbox->y0 = y0;
+    bbox->x1 = x1;
+    bbox->y1 = y1;
+    return;
+  }
+
+  bbox->x0 = x0 < bbox->x0 ? x0 : bbox->x0;
+  bbox->y0 = y0 < bbox->y0 ? y0 : bbox->y0;
+  bbox->x1 = x1 > bbox->x1 ? x1 : bbox->x1;
+  bbox->y1 = y1 > bbox->y1 ? y1 : bbox->y1;
+}
+
+/*
+ * Mark the tiles whose luma changed and copy the new luma over the old one.
+ * Tiles flagged in clean are taken as unchanged without looking at them.
+ * Returns the number of dirty tiles.
+ */
+static inline int
+incremental_diff(incremental_t *inc, const uint8_t *in, const uint8_t *clean)
+{
+  const int ntiles = inc->ntx * inc->nty;
+  int ndirty = 0;
+
+  INCREMENTAL_PARALLEL_FOR
+  for (int t = 0; t < ntiles; t++) {
+    const inc_rect_t r = incremental_tile_rect(inc, t % inc->ntx, t / inc->ntx);
+    const size_t len = r.x1 - r.x0;
+    int y;
+
+    if (inc->reach && !inc->reach[t]) {
+      inc->dirty[t] = 0;
+      continue;
+    }
+
+    inc->dirty[t] = !inc->primed;
+
+    if (inc->primed && clean && clean[t])
+      continue;
+
+    for (y = r.y0; y < r.y1 && !inc->dirty[t]; y++) {
+      const size_t o = (size_t) y * inc->width + r.x0;
+      inc->dirty[t] = memcmp(inc->prev + o, in + o, len) != 0;
+    }
+
+    if (inc->dirty[t]) {
+      for (y = r.y0; y < r.y1; y++) {
+        const size_t o = (size_t) y * inc->width + r.x0;
+        memcpy(inc->prev + o, in + o, len);
+      }
+    }
+  }
+
+  for (int t = 0; t < ntiles; t++)
+    ndirty += inc->dirty[t];
+
+  return ndirty;
+}
+
+/*
+ * Work out, for every tile, which part of it each stage has to recompute.
+ * A changed luma pixel reaches khalf pixels through the blur, one more through
+ * Sobel and one more through non-maximum suppression. Those reaches are at
+ * most a tile wide, so only the 8 neighbouring tiles have to be considered.
+ */
+static inline void
+incremental_plan(incremental_t *inc)
+{
+  const int khalf = inc->kn / 2;
+  const int all = khalf + 2 > INCREMENTAL_TILE;
+  const inc_rect_t domain[INC_STAGES] = {
+    {khalf, khalf, inc->width - khalf, inc->height - khalf},
+    {1, 1, inc->width - 1, inc->height - 1},
+    {1, 1, inc->width - 1, inc->height - 1},
+  };
+  int stage, tx, ty, nx, ny;
+
+  for (stage = INC_NMS; stage >= INC_BLUR; stage--) {
+    for (ty = 0; ty < inc->nty; ty++) {
+      for (tx = 0; tx < inc->ntx; tx++) {
+        const inc_rect_t tile = incremental_tile_rect(inc, tx, ty);
+        inc_rect_t clip = tile;
+        inc_rect_t *r = &inc->rects[stage][ty * inc->ntx + tx];
+
+        clip.x0 = clip.x0 > domain[stage].x0 ? clip.x0 : domain[stage].x0;
+        clip.y0 = clip.y0 > domain[stage].y0 ? clip.y0 : domain[stage].y0;
+        clip.x1 = clip.x1 < domain[stage].x1 ? clip.x1 : domain[stage].x1;
+        clip.y1 = clip.y1 < domain[stage].y1 ? clip.y1 : domain[stage].y1;
+
+        r->x0 = r->x1 = 0;
+
+        if (stage == INC_NMS && inc->roi && !inc->roi[ty * inc->ntx + tx])
+          continue;
+
+        for (ny = ty - 1; ny <= ty + 1; ny++) {
+          for (nx = tx - 1; nx <= tx + 1; nx++) {
+            const int n = ny * inc->ntx + nx;
+
+            if (nx < 0 || ny < 0 || nx >= inc->ntx || ny >= inc->nty)
+              continue;
+
+            if (all) {
+              incremental_rect_merge(r, tile, 0, clip);
+            } else if (stage == INC_NMS) {
+              if (inc->dirty[n])
+                incremental_rect_merge(r, incremental_tile_rect(inc, nx, ny), khalf + 2, clip);
+            } else {
+              incremental_rect_merge(r, inc->rects[stage + 1][n], 1, clip);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+static inline void
+incremental_blur(incremental_t *inc, const uint8_t *in, const inc_rect_t r)
+{
+  const int nx = inc->width;
+  const size_t o = (size_t) r.y0 * nx + r.x0;
+
+  kernel_convolve_u8(inc->kn)(in + o, nx, inc->blur + o, nx, inc->kernel, inc->kn,
+                              r.x1 - r.x0, r.y1 - r.y0, true);
+}
+
+static inline void
+incremental_gradient(incremental_t *inc, const inc_rect_t r)
+{
+  static const float Gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+  static const float Gy[] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+  const int nx = inc->width;
+  int m, n, i, j;
+
+  for (n = r.y0; n < r.y1; n++) {
+    for (m = r.x0; m < r.x1; m++) {
+      float px = 0, py = 0;
+      size_t c = 0;
+
+      for (j = -1; j <= 1; j++) {
+        for (i = -1; i <= 1; i++) {
+          px += inc->blur[(n - j) * nx + m - i] * Gx[c];
+          py += inc->blur[(n - j) * nx + m - i] * Gy[c++];
+        }
+      }
+
+      inc->after_Gx[n * nx + m] = (int16_t) px;
+      inc->after_Gy[n * nx + m] = (int16_t) py;
+      inc->G[n * nx + m] = (int16_t) hypot(inc->after_Gx[n * nx + m], inc->after_Gy[n * nx + m]);
+    }
+  }
+}
+
+static inline void
+incremental_nms(incremental_t *inc, const inc_rect_t r)
+{
+  const int width = inc->width;
+  const int16_t *G = inc->G;
+  int i, j;
+
+  for (j = r.y0; j < r.y1; j++) {
+    for (i = r.x0; i < r.x1; i++) {
+      const int c = i + width * j;
+      const int nn = c - width;
+      const int ss = c + width;
+      const int ww = c + 1;
+      const int ee = c - 1;
+      const int nw = nn + 1;
+      const int ne = nn - 1;
+      const int sw = ss + 1;
+      const int se = ss - 1;
+      const float dir = (float) (fmod(atan2(inc->after_Gy[c], inc->after_Gx[c]) + M_PI, M_PI) / M_PI) * 8;
+
+      if (((dir <= 1 || dir > 7) && G[c] > G[ee] && G[c] > G[ww]) || // 0 deg
+          ((dir > 1 && dir <= 3) && G[c] > G[nw] && G[c] > G[se]) || // 45 deg
+          ((dir > 3 && dir <= 5) && G[c] > G[nn] && G[c] > G[ss]) || // 90 deg
+          ((dir > 5 && dir <= 7) && G[c] > G[ne] && G[c] > G[sw]))   // 135 deg
+        inc->nms[c] = G[c];
+      else
+        inc->nms[c] = 0;
+    }
+  }
+}
+
+/*
+ * Grow the edges on the stack into the neighbouring weak pixels.
+ */
+static inline void
+incremental_trace(incremental_t *inc, int nedges, const int t1)
+{
+  const int width = inc->width;
+  int k;
+
+  while (nedges > 0) {
+    const int e = inc->stack[--nedges];
+    const int nbs[8] = {e - width, e + width, e + 1, e - 1,
+                        e - width + 1, e - width - 1, e + width + 1, e + width - 1};
+
+    for (k = 0; k < 8; k++) {
+      if (hysteresis_interior(nbs[k], width, inc->height) &&
+          inc->nms[nbs[k]] >= t1 && inc->out[nbs[k]] == 0) {
+        inc->out[nbs[k]] = INCREMENTAL_MAX_BRIGHTNESS;
+        inc->stack[nedges++] = nbs[k];
+      }
+    }
+  }
+}
+
+/*
+ * The full-frame tracer only looks for strong pixels at indices
+ * 1 .. (width - 2) * (height - 2), so the same range is used here.
+ */
+static inline void
+incremental_seed(incremental_t *inc, const int p, const int t1, const int t2)
+{
+  const int last = (inc->width - 2) * (inc->height - 2);
+
+  if (p >= 1 && p <= last && inc->nms[p] >= t2 && inc->out[p] == 0) {
+    inc->out[p] = INCREMENTAL_MAX_BRIGHTNESS;
+    inc->stack[0] = p;
+    incremental_trace(inc, 1, t1);
+  }
+}
+
+/*
+ * Hysteresis restricted to the area R where non-maximum suppression was
+ * recomputed. The edge map is the union of the weak components holding a
+ * strong pixel, so only components touching R can change:
+ *  1. clear every edge connected to a pixel of R,
+ *  2. let the remaining edges next to R grow into it,
+ *  3. trace again from the strong pixels of R and of the cleared edges.
+ */
+static inline void
+incremental_hysteresis(incremental_t *inc, const int t1, const int t2)
+{
+  const int width = inc->width;
+  const int ntiles = inc->ntx * inc->nty;
+  const inc_rect_t frame = {0, 0, inc->width, inc->height};
+  int ncleared = 0;
+  int t, x, y, k;
+
+  for (t = 0; t < ntiles; t++) {
+    const inc_rect_t r = inc->rects[INC_NMS][t];
+
+    for (y = r.y0; y < r.y1; y++) {
+      for (x = r.x0; x < r.x1; x++) {
+        int nedges = 0;
+
+        if (inc->out[y * width + x] == 0)
+          continue;
+
+        inc->out[y * width + x] = 0;
+        inc->cleared[ncleared++] = y * width + x;
+        inc->stack[nedges++] = y * width + x;
+
+        while (nedges > 0) {
+          const int e = inc->stack[--nedges];
+          const int nbs[8] = {e - width, e + width, e + 1, e - 1,
+                              e - width + 1, e - width - 1, e + width + 1, e + width - 1};
+
+          for (k = 0; k < 8; k++) {
+            if (inc->out[nbs[k]]) {
+              inc->out[nbs[k]] = 0;
+              inc->cleared[ncleared++] = nbs[k];
+              inc->stack[nedges++] = nbs[k];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (t = 0; t < ntiles; t++) {
+    inc_rect_t ring = {0, 0, 0, 0};
+
+    incremental_rect_merge(&ring, inc->rects[INC_NMS][t], 1, frame);
+
+    for (y = ring.y0; y < ring.y1; y++) {
+      for (x = ring.x0; x < ring.x1; x++) {
+        if (inc->out[y * width + x]) {
+          inc->stack[0] = y * width + x;
+          incremental_trace(inc, 1, t1);
+        }
+      }
+    }
+  }
+
+  for (t = 0; t < ntiles; t++) {
+    const inc_rect_t r = inc->rects[INC_NMS][t];
+
+    for (y = r.y0; y < r.y1; y++)
+      for (x = r.x0; x < r.x1; x++)
+        incremental_seed(inc, y * width + x, t1, t2);
+  }
+
+  for (k = 0; k < ncleared; k++)
+    incremental_seed(inc, inc->cleared[k], t1, t2);
+}
+
+/*
+ * Detect the edges of in, a width * height luma plane. If clean is not NULL,
+ * it flags the tiles known to be unchanged. Returns the edge map (0 or
+ * MAX_BRIGHTNESS), owned by inc and valid until the next call.
+ */
+static inline uint8_t *
+incremental_canny_edge_detection(incremental_t *inc,
+                                 const uint8_t *in,
+                                 const uint8_t *clean,
+                                 const int      t1,
+                                 const int      t2)
+{
+  const int ntiles = inc->ntx * inc->nty;
+
+  inc->tiles_total += ntiles;
+  inc->tiles_dirty += incremental_diff(inc, in, clean);
+
+  incremental_plan(inc);
+
+  INCREMENTAL_PARALLEL_FOR
+  for (int t = 0; t < ntiles; t++)
+    incremental_blur(inc, in, inc->rects[INC_BLUR][t]);
+
+  INCREMENTAL_PARALLEL_FOR
+  for (int t = 0; t < ntiles; t++)
+    incremental_gradient(inc, inc->rects[INC_GRADIENT][t]);
+
+  INCREMENTAL_PARALLEL_FOR
+  for (int t = 0; t < ntiles; t++)
+    incremental_nms(inc, inc->rects[INC_NMS][t]);
+
+  incremental_hysteresis(inc, t1, t2);
+  inc->primed = 1;
+
+  return inc->out;
+}
+
+#endif
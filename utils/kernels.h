@@ -0,0 +1,157 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Convolution taps unrolled at compile time.
+ *
+ * gaussian_filter() only ever builds kernels of size 3, 5, 7, 9 or 11 for
+ * sigma < 2.5 (7 for the default sigma of 1.0), and the Sobel operators are
+ * 3x3. For those sizes the macros below expand the whole 2-D sum into a
+ * single expression with constant offsets, so no loop or index arithmetic is
+ * left per tap. The terms are added in the same order as the generic loop
+ * below, so both give bit-identical results.
+ *
+ * kernel_taps_N() takes a pointer to the centre pixel and returns:
+ *
+ *   sum over j, i in [-kn / 2, kn / 2] of in[-j * nx - i] * kernel[c++]
+ */
+
+#define KERNEL_TAP(j, i, n) \
+  + in[-(j) * nx - (i)] * kernel[((j) + (n) / 2) * (n) + (i) + (n) / 2]
+
+/* One row of taps, i from -n / 2 to n / 2. */
+#define KERNEL_ROW_3(j, n) \
+  KERNEL_TAP(j, -1, n) KERNEL_TAP(j, 0, n) KERNEL_TAP(j, 1, n)
+#define KERNEL_ROW_5(j, n) \
+  KERNEL_TAP(j, -2, n) KERNEL_ROW_3(j, n) KERNEL_TAP(j, 2, n)
+#define KERNEL_ROW_7(j, n) \
+  KERNEL_TAP(j, -3, n) KERNEL_ROW_5(j, n) KERNEL_TAP(j, 3, n)
+#define KERNEL_ROW_9(j, n) \
+  KERNEL_TAP(j, -4, n) KERNEL_ROW_7(j, n) KERNEL_TAP(j, 4, n)
+#define KERNEL_ROW_11(j, n) \
+  KERNEL_TAP(j, -5, n) KERNEL_ROW_9(j, n) KERNEL_TAP(j, 5, n)
+
+/* All the rows, j from -n / 2 to n / 2. */
+#define KERNEL_ROWS_3(n) \
+  KERNEL_ROW_##n(-1, n) KERNEL_ROW_##n(0, n) KERNEL_ROW_##n(1, n)
+#define KERNEL_ROWS_5(n) \
+  KERNEL_ROW_##n(-2, n) KERNEL_ROWS_3(n) KERNEL_ROW_##n(2, n)
+#define KERNEL_ROWS_7(n) \
+  KERNEL_ROW_##n(-3, n) KERNEL_ROWS_5(n) KERNEL_ROW_##n(3, n)
+#define KERNEL_ROWS_9(n) \
+  KERNEL_ROW_##n(-4, n) KERNEL_ROWS_7(n) KERNEL_ROW_##n(4, n)
+#define KERNEL_ROWS_11(n) \
+  KERNEL_ROW_##n(-5, n) KERNEL_ROWS_9(n) KERNEL_ROW_##n(5, n)
+
+/*
+ * The taps are inlined into the loops below even in unoptimized builds, which
+ * is what the Makefiles produce.
+ */
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+#define KERNEL_DEFINE_TAPS(name, type, n)                                 \
+  KERNEL_INLINE float                                                     \
+  name##_##n(const type *in, const int nx, const float *kernel)           \
+  {                                                                       \
+    return 0.0f KERNEL_ROWS_##n(n);                                       \
+  }
+
+/*
+ * Whole convolution loops, one per kernel size.
+ *
+ * Picking the taps once per pixel through a function pointer costs an
+ * indirect call per pixel, which the compiler cannot inline. So the loop over
+ * a whole w x h rectangle is generated for every specialized size, with the
+ * taps inlined, and kernel_convolve(kn) picks the loop once per call: the
+ * specialization, or the generic loop for the other sizes.
+ *
+ * in and out point at the top left pixel of the rectangle, each with its own
+ * stride, so that rows of a ring or of a tile buffer can be convolved as well
+ * as a whole frame. If normalize is true, the sums are mapped to range
+ * 0 -> 255 like a blur's.
+ */
+
+KERNEL_INLINE short int
+kernel_output(float pixel, const bool normalize)
+{
+  const float min = 0.5;
+  const float max = 254.5;
+
+  if (normalize == true)
+    pixel = 255 * (pixel - min) / (max - min);
+
+  return (short int) pixel;
+}
+
+#define KERNEL_CONVOLVE_ARGS(type)                                        \
+  const type *in, const int in_nx, short int *out, const int out_nx,      \
+  const float *kernel, const int kn, const int w, const int h,            \
+  const bool normalize
+
+#define KERNEL_DEFINE_CONVOLVE(name, conv, type, n)                       \
+  static inline void                                                      \
+  conv##_##n(KERNEL_CONVOLVE_ARGS(type))                                  \
+  {                                                                       \
+    (void) kn;                                                            \
+    for (int y = 0; y < h; y++)                                           \
+      for (int x = 0; x < w; x++)                                         \
+        out[(size_t) y * out_nx + x] =                                    \
+          kernel_output(name##_##n(in + (size_t) y * in_nx + x, in_nx,    \
+                                   kernel), normalize);                   \
+  }
+
+#define KERNEL_DEFINE_ALL_TAPS(name, conv, type)                          \
+  KERNEL_DEFINE_TAPS(name, type, 3)                                       \
+  KERNEL_DEFINE_TAPS(name, type, 5)                                       \
+  KERNEL_DEFINE_TAPS(name, type, 7)                                       \
+  KERNEL_DEFINE_TAPS(name, type, 9)                                       \
+  KERNEL_DEFINE_TAPS(name, type, 11)                                      \
+                                                                          \
+  KERNEL_DEFINE_CONVOLVE(name, conv, type, 3)                             \
+  KERNEL_DEFINE_CONVOLVE(name, conv, type, 5)                             \
+  KERNEL_DEFINE_CONVOLVE(name, conv, type, 7)                             \
+  KERNEL_DEFINE_CONVOLVE(name, conv, type, 9)                             \
+  KERNEL_DEFINE_CONVOLVE(name, conv, type, 11)                            \
+                                                                          \
+  /* Any odd size, summing in the same order as the taps. */              \
+  static inline void                                                      \
+  conv##_any(KERNEL_CONVOLVE_ARGS(type))                                  \
+  {                                                                       \
+    const int khalf = kn / 2;                                             \
+    for (int y = 0; y < h; y++) {                                         \
+      for (int x = 0; x < w; x++) {                                       \
+        const type *centre = in + (size_t) y * in_nx + x;                 \
+        float pixel = 0;                                                  \
+        size_t c = 0;                                                     \
+        for (int j = -khalf; j <= khalf; j++)                             \
+          for (int i = -khalf; i <= khalf; i++)                           \
+            pixel += centre[-j * in_nx - i] * kernel[c++];                \
+        out[(size_t) y * out_nx + x] = kernel_output(pixel, normalize);   \
+      }                                                                   \
+    }                                                                     \
+  }                                                                       \
+                                                                          \
+  typedef void (*conv##_t)(KERNEL_CONVOLVE_ARGS(type));                   \
+                                                                          \
+  static inline conv##_t                                                  \
+  conv(const int kn)                                                      \
+  {                                                                       \
+    switch (kn) {                                                         \
+    case 3: return conv##_3;                                              \
+    case 5: return conv##_5;                                              \
+    case 7: return conv##_7;                                              \
+    case 9: return conv##_9;                                              \
+    case 11: return conv##_11;                                            \
+    default: return conv##_any;                                           \
+    }                                                                     \
+  }
+
+/* For pixel_t (short int) images, and for the 8-bit luma. */
+KERNEL_DEFINE_ALL_TAPS(kernel_taps, kernel_convolve, short int)
+KERNEL_DEFINE_ALL_TAPS(kernel_taps_u8, kernel_convolve_u8, uint8_t)
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/motion_vector.h>
+
+#include "utils.h"
+
+/*
+ * Change detection from the motion vectors exported by the decoder.
+ *
+ * The MPEG decoder knows which macroblocks of a P frame were copied from the
+ * previous frame. When the decoder is opened with the "+export_mvs" flags2
+ * option, every decoded AVFrame carries those motion vectors as side data.
+ * A tile whose area is entirely covered by zero-length vectors pointing into
+ * the previous frame is considered unchanged, without comparing any pixels.
+ *
+ * This is a heuristic: a zero-motion macroblock may still carry a residual,
+ * so small changes inside such blocks are missed until the tile changes for
+ * another reason.
+ */
+
+#define MOTION_BLOCK 8
+
+typedef struct {
+  int width;
+  int height;
+  int nbx, nby;                 // 8x8 blocks per row and column
+  uint8_t *blocks;              // 1 = covered by a zero-motion vector, 2 = moving
+  enum AVPictureType prev_type;
+} motion_t;
+
+static inline motion_t *
+motion_create(const int width, const int height)
+{
+  motion_t *mo = calloc(1, sizeof(motion_t));
+  DIE(mo == NULL, "calloc");
+
+  mo->width = width;
+  mo->height = height;
+  mo->nbx = (width + MOTION_BLOCK - 1) / MOTION_BLOCK;
+  mo->nby = (height + MOTION_BLOCK - 1) / MOTION_BLOCK;
+  mo->prev_type = AV_PICTURE_TYPE_NONE;
+
+  mo->blocks = malloc(mo->nbx * mo->nby);
+  DIE(mo->blocks == NULL, "malloc");
+
+  return mo;
+}
+
+static inline void
+motion_free(motion_t *mo)
+{
+  free(mo->blocks);
+  free(mo);
+}
+
+/*
+ * Fill clean with one flag per tile x tile tile (ntx tiles per row), set for
+ * the tiles the decoder copied unchanged from the previous frame. Returns 0,
+ * leaving clean untouched, if frame carries no usable motion vectors.
+ */
+static inline int
+motion_clean_tiles(motion_t      *mo,
+                   const AVFrame *frame,
+                   const int      tile,
+                   const int      ntx,
+                   const int      nty,
+                   uint8_t       *clean)
+{
+  const AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+  const enum AVPictureType prev_type = mo->prev_type;
+  const AVMotionVector *mvs;
+  int i, n, bx, by, tx, ty;
+
+  mo->prev_type = frame->pict_type;
+
+  /*
+   * Only a P frame that directly follows its reference (no B frames in
+   * between) is predicted from the previous frame in display order.
+   */
+  if (sd == NULL || frame->pict_type != AV_PICTURE_TYPE_P ||
+      prev_type == AV_PICTURE_TYPE_B || prev_type == AV_PICTURE_TYPE_NONE)
+    return 0;
+
+  memset(mo->blocks, 0, mo->nbx * mo->nby);
+
+  mvs = (const AVMotionVector *) sd->data;
+  n = sd->size / sizeof(AVMotionVector);
+
+  for (i = 0; i < n; i++) {
+    const AVMotionVector *mv = &mvs[i];
+    const int still = mv->source < 0 && mv->src_x == mv->dst_x && mv->src_y == mv->dst_y;
+    const int x0 = (mv->dst_x - mv->w / 2) / MOTION_BLOCK;
+    const int y0 = (mv->dst_y - mv->h / 2) / MOTION_BLOCK;
+    const int x1 = (mv->dst_x + mv->w / 2 + MOTION_BLOCK - 1) / MOTION_BLOCK;
+    const int y1 = (mv->dst_y + mv->h / 2 + MOTION_BLOCK - 1) / MOTION_BLOCK;
+
+    for (by = y0 < 0 ? 0 : y0; by < y1 && by < mo->nby; by++) {
+      for (bx = x0 < 0 ? 0 : x0; bx < x1 && bx < mo->nbx; bx++) {
+        uint8_t *b = &mo->blocks[by * mo->nbx + bx];
+        *b = still && *b != 2 ? 1 : 2;
+      }
+    }
+  }
+
+  for (ty = 0; ty < nty; ty++) {
+    for (tx = 0; tx < ntx; tx++) {
+      const int bx1 = ((tx + 1) * tile + MOTION_BLOCK - 1) / MOTION_BLOCK;
+      const int by1 = ((ty + 1) * tile + MOTION_BLOCK - 1) / MOTION_BLOCK;
+      int still = 1;
+
+      for (by = ty * tile / MOTION_BLOCK; by < by1 && by < mo->nby && still; by++)
+        for (bx = tx * tile / MOTION_BLOCK; bx < bx1 && bx < mo->nbx && still; bx++)
+          still = mo->blocks[by * mo->nbx + bx] == 1;
+
+      clean[ty * ntx + tx] = still;
+    }
+  }
+
+  return 1;
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+/*
+ * Fast preview mode: Canny runs on the luma downsampled by a factor of 2 or 4.
+ *
+ * Downsampling is fused with the Gaussian blur: the blur is only evaluated at
+ * the centre of every factor x factor block, as two separable passes. The blur
+ * is widened to factor * sigma so that the small image holds the same scale
+ * space as the full-resolution pipeline, and the thresholds are rescaled by
+ * the ratio of the two pipelines' response to a step edge.
+ */
+
+#define PREVIEW_MAX_BRIGHTNESS 255
+
+#ifdef _OPENMP
+#define PREVIEW_PARALLEL_FOR \
+  _Pragma("omp parallel for num_threads(nthreads)")
+#else
+#define PREVIEW_PARALLEL_FOR
+#endif
+
+static inline int
+preview_kernel(const float sigma, float **weights)
+{
+  const int n = 2 * (int) (2 * sigma) + 3;
+  const int khalf = n / 2;
+  int i;
+
+  *weights = malloc(n * sizeof(float));
+  DIE(*weights == NULL, "malloc");
+
+  for (i = 0; i < n; i++)
+    (*weights)[i] = exp(-0.5 * pow((i - khalf) / sigma, 2.0));
+
+  return n;
+}
+
+/*
+ * Peak Sobel response to a unit step edge, blurred by the separable Gaussian
+ * of the given sigma and sampled every factor pixels (averaged over phases).
+ */
+static inline float
+preview_step_response(const float sigma, const int factor)
+{
+  float *w;
+  const int n = preview_kernel(sigma, &w);
+  const int khalf = n / 2;
+  float column = 0, best, sum = 0;
+  int phase, x, i;
+
+  for (i = 0; i < n; i++)
+    column += w[i];
+  column /= 2 * M_PI * sigma * sigma;
+
+  for (phase = 0; phase < factor; phase++) {
+    best = 0;
+
+    for (x = -2 * n; x <= 2 * n; x++) {
+      float before = 0, after = 0;
+
+      /* Blurred step (0 left of the edge, 1 right of it) at x - 1 and x + 1. */
+      for (i = -khalf; i <= khalf; i++) {
+        before += w[i + khalf] * ((x - 1) * factor + phase - i >= 0);
+        after += w[i + khalf] * ((x + 1) * factor + phase - i >= 0);
+      }
+
+      if ((after - before) * column > best)
+        best = (after - before) * column;
+    }
+
+    sum += best;
+  }
+
+  free(w);
+
+  /* Sobel weighs the difference by 1 + 2 + 1 across the edge. */
+  return 4 * sum / factor;
+}
+
+/*
+ * Factor by which the thresholds are multiplied in preview mode.
+ */
+static inline float
+preview_threshold_scale(const float sigma, const int factor)
+{
+  return preview_step_response(factor * sigma, factor) / preview_step_response(sigma, 1);
+}
+
+/*
+ * Blur in (width x height) with factor * sigma and write every factor-th
+ * sample to out. The downscaled image has (width / factor) x (height / factor)
+ * pixels, of which only rows [row_begin, row_end) are written, starting at
+ * out. Pixels outside the frame replicate the nearest border pixel.
+ */
+static inline void
+preview_downsample(const uint8_t *in,
+                   uint8_t       *out,
+                   const int      width,
+                   const int      height,
+                   const int      factor,
+                   const float    sigma,
+                   const int      row_begin,
+                   const int      row_end,
+                   const int      nthreads)
+{
+  const int sw = width / factor;
+  const float s = factor * sigma;
+  const float norm = 2 * M_PI * s * s;
+  const float min = 0.5;
+  const float max = 254.5;
+  float *w;
+  const int n = preview_kernel(s, &w);
+  const int khalf = n / 2;
+
+  /* Input rows needed by the vertical pass. */
+  int y0 = row_begin * factor + factor / 2 - khalf;
+  int y1 = (row_end - 1) * factor + factor / 2 + khalf + 1;
+  y0 = y0 < 0 ? 0 : y0;
+  y1 = y1 > height ? height : y1;
+
+  /* Horizontal pass, only for the columns that are kept. */
+  float *tmp = malloc((size_t) (y1 - y0) * sw * sizeof(float));
+  DIE(tmp == NULL, "malloc");
+
+  (void) nthreads;
+
+  PREVIEW_PARALLEL_FOR
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < sw; x++) {
+      const int cx = x * factor + factor / 2;
+      float pixel = 0;
+
+      for (int i = -khalf; i <= khalf; i++) {
+        int sx = cx - i;
+        sx = sx < 0 ? 0 : sx >= width ? width - 1 : sx;
+        pixel += in[(size_t) y * width + sx] * w[i + khalf];
+      }
+
+      tmp[(size_t) (y - y0) * sw + x] = pixel;
+    }
+  }
+
+  /* Vertical pass, only for the rows that are kept. */
+  PREVIEW_PARALLEL_FOR
+  for (int y = row_begin; y < row_end; y++) {
+    const int cy = y * factor + factor / 2;
+
+    for (int x = 0; x < sw; x++) {
+      float pixel = 0;
+
+      for (int j = -khalf; j <= khalf; j++) {
+        int sy = cy - j;
+        sy = sy < 0 ? 0 : sy >= height ? height - 1 : sy;
+        pixel += tmp[(size_t) (sy - y0) * sw + x] * w[j + khalf];
+      }
+
+      pixel = PREVIEW_MAX_BRIGHTNESS * (pixel / norm - min) / (max - min);
+      out[(size_t) (y - row_begin) * sw + x] = pixel < 0 ? 0 : pixel > PREVIEW_MAX_BRIGHTNESS ? PREVIEW_MAX_BRIGHTNESS : (uint8_t) pixel;
+    }
+  }
+
+  free(tmp);
+  free(w);
+}
+
+/*
+ * Nearest-neighbour upsampling of a (width / factor) x (height / factor) edge
+ * map back to rows [row_begin, row_end) of a width x height image. Rows and
+ * columns past the last full block are set to 0.
+ */
+static inline void
+preview_upsample(const uint8_t *in,
+                 uint8_t       *out,
+                 const int      width,
+                 const int      height,
+                 const int      factor,
+                 const int      row_begin,
+                 const int      row_end,
+                 const int      nthreads)
+{
+  const int sw = width / factor;
+  const int sh = height / factor;
+
+  (void) nthreads;
+
+  PREVIEW_PARALLEL_FOR
+  for (int y = row_begin; y < row_end; y++) {
+    uint8_t *row = out + (size_t) y * width;
+
+    if (y >= sh * factor) {
+      memset(row, 0, width);
+      continue;
+    }
+
+    for (int x = 0; x < sw * factor; x++)
+      row[x] = in[(size_t) (y / factor) * sw + x / factor];
+    memset(row + sw * factor, 0, width - sw * factor);
+  }
+}
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef PULL_H
+#define PULL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpi.h"
+#include "utils.h"
+
+/*
+ * Pull-based scheduling of a frame over MPI workers.
+ *
+ * The frame is cut into work units of rows, each sent with PULL_HALO rows of
+ * context above and below so that the blur and the gradient are right at its
+ * edges. Every worker starts with one unit; from then on, sending back a
+ * result is how a worker asks for the next one, so a fast worker simply
+ * processes more units than a slow or busy one instead of the whole frame
+ * waiting for the slowest strip. Results come back in any order and are put
+ * in place by unit, so the frame is whole before it is encoded.
+ *
+ * Protocol, per unit: PULL_TAG_SIZE {width, rows}, then PULL_TAG_WORK with
+ * the rows; the worker answers PULL_TAG_WORK with as many rows of edges.
+ * {0, 0} tells a worker to stop.
+ */
+
+#define PULL_TAG_WORK 42
+#define PULL_TAG_SIZE 43
+#define PULL_HALO 20
+
+/*
+ * Units per worker when the unit height is not given. Each unit costs its
+ * worker 2 * PULL_HALO extra rows and cuts the edge tracing at its borders,
+ * so the default height is at least PULL_MIN_ROWS and a multiple of the
+ * halo; a frame no taller than that goes out whole.
+ */
+#define PULL_UNITS_PER_WORKER 4
+#define PULL_MIN_ROWS (4 * PULL_HALO)
+
+typedef struct {
+  int num_workers;
+  int unit_rows;            // 0 to pick it from the frame height
+  uint8_t *buffer;
+  size_t buffer_size;
+  int *assigned;            // unit of every worker, -1 if idle
+} pull_t;
+
+static inline void
+pull_init(pull_t *p, const int num_workers, const int unit_rows, uint8_t *buffer,
+          const size_t buffer_size)
+{
+  p->num_workers = num_workers;
+  p->unit_rows = unit_rows;
+  p->buffer = buffer;
+  p->buffer_size = buffer_size;
+
+  p->assigned = malloc(num_workers * sizeof(int));
+  DIE(p->assigned == NULL, "malloc");
+}
+
+static inline void
+pull_free(pull_t *p)
+{
+  free(p->assigned);
+}
+
+/*
+ * First and last row sent for the unit starting at row y0 and ending before
+ * row y1.
+ */
+static inline int
+pull_top(const int y0)
+{
+  return y0 > PULL_HALO ? y0 - PULL_HALO : 0;
+}
+
+static inline int
+pull_bottom(const int y1, const int height)
+{
+  return y1 + PULL_HALO < height ? y1 + PULL_HALO : height;
+}
+
+static inline void
+pull_send(pull_t *p, const int worker, const int unit, const uint8_t *in, const int width,
+          const int height, const int rows)
+{
+  const int top = pull_top(unit * rows);
+  const int bottom = pull_bottom(unit * rows + rows < height ? unit * rows + rows : height, height);
+  int size[2] = {width, bottom - top};
+
+  DIE((size_t) width * size[1] > p->buffer_size, "work unit larger than the buffer");
+
+  MPI_Send(size, 2, MPI_INT, worker, PULL_TAG_SIZE, MPI_COMM_WORLD);
+  MPI_Send((void *) (in + (size_t) top * width), width * size[1], MPI_UNSIGNED_CHAR, worker,
+           PULL_TAG_WORK, MPI_COMM_WORLD);
+
+  p->assigned[worker] = unit;
+}
+
+/*
+ * Height of the units of a frame height rows high.
+ */
+static inline int
+pull_rows(const pull_t *p, const int height)
+{
+  const int n = PULL_UNITS_PER_WORKER * p->num_workers;
+  int rows;
+
+  if (p->unit_rows > 0)
+    return p->unit_rows;
+
+  rows = (height + n - 1) / n;
+  rows = (rows + PULL_HALO - 1) / PULL_HALO * PULL_HALO;
+  if (rows < PULL_MIN_ROWS)
+    rows = PULL_MIN_ROWS;
+
+  return rows < height ? rows : height;
+}
+
+/*
+ * Detect the edges of a width x height frame, in, into out.
+ */
+static inline void
+pull_frame(pull_t *p, const uint8_t *in, uint8_t *out, const int width, const int height)
+{
+  const int rows = pull_rows(p, height);
+  const int units = (height + rows - 1) / rows;
+  int next = 0, done = 0, worker;
+  MPI_Status status;
+
+  for (worker = 0; worker < p->num_workers; worker++) {
+    p->assigned[worker] = -1;
+
+    if (next < units)
+      pull_send(p, worker, next++, in, width, height, rows);
+  }
+
+  while (done < units) {
+    MPI_Recv(p->buffer, p->buffer_size, MPI_UNSIGNED_CHAR, MPI_ANY_SOURCE, PULL_TAG_WORK,
+             MPI_COMM_WORLD, &status);
+    worker = status.MPI_SOURCE;
+
+    const int unit = p->assigned[worker];
+    const int y0 = unit * rows;
+    const int y1 = y0 + rows < height ? y0 + rows : height;
+
+    memcpy(out + (size_t) y0 * width, p->buffer + (size_t) (y0 - pull_top(y0)) * width,
+           (size_t) (y1 - y0) * width);
+    done++;
+
+    p->assigned[worker] = -1;
+    if (next < units)
+      pull_send(p, worker, next++, in, width, height, rows);
+  }
+}
+
+/*
+ * Tell every worker that there is no more work.
+ */
+static inline void
+pull_stop(pull_t *p)
+{
+  int size[2] = {0, 0};
+  int worker;
+
+  for (worker = 0; worker < p->num_workers; worker++)
+    MPI_Send(size, 2, MPI_INT, worker, PULL_TAG_SIZE, MPI_COMM_WORLD);
+}
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/*
+ * Region of interest: the part of the frame that edges are detected in.
+ *
+ * It is given either as a comma-separated list of rectangles in X geometry
+ * syntax, WIDTHxHEIGHT+X+Y, e.g. "640x360+0+0,200x200+1200+600", or as a
+ * binary PGM (P5) mask of the frame size whose nonzero pixels are inside.
+ * Detection works on tiles, so the region is rounded out to whole tiles: a
+ * tile is in it if any of its pixels is. Everything outside comes out
+ * without edges.
+ */
+
+#define ROI_MAX 64
+
+/* Half-open rectangle [x0, x1) x [y0, y1). */
+typedef struct {
+  int x0, y0, x1, y1;
+} roi_rect_t;
+
+typedef struct {
+  int n;
+  roi_rect_t rects[ROI_MAX];
+  const char *mask;         // PGM file, if not given as rectangles
+} roi_t;
+
+static inline bool
+roi_active(const roi_t *roi)
+{
+  return roi->n > 0 || roi->mask != NULL;
+}
+
+/*
+ * Parse spec into roi. A spec that starts with WIDTHx is a list of
+ * rectangles; anything else is the path of a mask, which is only read by
+ * roi_tiles(). Returns 0 on success, -1 if the rectangles do not parse, one
+ * is empty or there are too many of them, or the mask cannot be read.
+ */
+static inline int
+roi_parse(roi_t *roi, const char *spec)
+{
+  const size_t digits = strspn(spec, "0123456789");
+  const char *p = spec;
+  int w, h, x, y, len;
+
+  roi->n = 0;
+  roi->mask = NULL;
+
+  if (digits == 0 || spec[digits] != 'x') {
+    if (access(spec, R_OK) < 0) {
+      perror(spec);
+      return -1;
+    }
+
+    roi->mask = spec;
+    return 0;
+  }
+
+  for (;;) {
+    if (sscanf(p, "%dx%d+%d+%d%n", &w, &h, &x, &y, &len) != 4)
+      return -1;
+    if (w <= 0 || h <= 0 || x < 0 || y < 0 || roi->n == ROI_MAX)
+      return -1;
+
+    roi->rects[roi->n++] = (roi_rect_t) {x, y, x + w, y + h};
+    p += len;
+
+    if (*p == '\0')
+      return 0;
+    if (*p++ != ',')
+      return -1;
+  }
+}
+
+/*
+ * Read a PGM mask, which must be width x height. Returns its pixels.
+ */
+static inline uint8_t *
+roi_read_mask(const char *path, const int width, const int height)
+{
+  unsigned long values[3];
+  uint8_t *mask;
+  int c, k;
+
+  FILE *f = fopen(path, "rb");
+  DIE(f == NULL, path);
+
+  DIE(fgetc(f) != 'P' || fgetc(f) != '5', "ROI mask is not a binary PGM");
+
+  for (k = 0; k < 3; k++) {
+    /* Whitespace and comments. */
+    while ((c = fgetc(f)) == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#') {
+      if (c == '#')
+        while ((c = fgetc(f)) != EOF && c != '\n')
+          ;
+    }
+
+    DIE(c < '0' || c > '9', "ROI mask has a malformed header");
+
+    values[k] = 0;
+    for (; c >= '0' && c <= '9'; c = fgetc(f))
+      values[k] = values[k] * 10 + c - '0';
+  }
+
+  /* The single whitespace character that ends the header was read above. */
+  DIE(values[2] == 0 || values[2] > 255, "ROI mask is not 8-bit");
+  DIE(values[0] != (unsigned long) width || values[1] != (unsigned long) height,
+      "ROI mask does not match the frame size");
+
+  mask = malloc((size_t) width * height);
+  DIE(mask == NULL, "malloc");
+
+  DIE(fread(mask, 1, (size_t) width * height, f) != (size_t) width * height, "ROI mask is truncated");
+  fclose(f);
+
+  return mask;
+}
+
+/*
+ * Flag in tiles, one byte per tile x tile square of a width x height frame in
+ * row-major order, the tiles in the region. Returns how many there are.
+ */
+static inline int
+roi_tiles(const roi_t *roi, const int width, const int height, const int tile, uint8_t *tiles)
+{
+  const int ntx = (width + tile - 1) / tile;
+  const int nty = (height + tile - 1) / tile;
+  int i, x, y, n = 0;
+
+  memset(tiles, 0, (size_t) ntx * nty);
+
+  for (i = 0; i < roi->n; i++) {
+    const roi_rect_t r = roi->rects[i];
+    const int x1 = r.x1 < width ? r.x1 : width;
+    const int y1 = r.y1 < height ? r.y1 : height;
+
+    if (r.x0 >= x1 || r.y0 >= y1)
+      continue;
+
+    for (y = r.y0 / tile; y * tile < y1; y++)
+      for (x = r.x0 / tile; x * tile < x1; x++)
+        tiles[y * ntx + x] = 1;
+  }
+
+  if (roi->mask) {
+    uint8_t *mask = roi_read_mask(roi->mask, width, height);
+
+    for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+        if (mask[(size_t) y * width + x])
+          tiles[(y / tile) * ntx + x / tile] = 1;
+
+    free(mask);
+  }
+
+  for (i = 0; i < ntx * nty; i++)
+    n += tiles[i];
+
+  return n;
+}
+
+#endif
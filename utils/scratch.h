@@ -0,0 +1,343 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+
+/*
+ * First-touch allocation of frame-sized scratch buffers.
+ *
+ * Linux places a page on the NUMA node of the thread that first writes it.
+ * malloc() recycles pages that some other thread, possibly on the other
+ * socket, touched for an earlier frame, so buffers are mapped fresh here
+ * instead and their rows are touched up front by the threads that will work
+ * on them: with nthreads > 1, split in contiguous blocks of rows the same
+ * way as the schedule(static) row loops of the OpenMP backend; with
+ * nthreads == 1, all by the calling thread, e.g. a Pthreads worker that
+ * allocates the buffers of its own strip.
+ *
+ * Like calloc(), the memory is zeroed.
+ *
+ * With scratch_stats.huge set, buffers of at least SCRATCH_HUGE_PAGE are
+ * backed by 2 MB pages, which take 512 times fewer faults and TLB entries to
+ * cover a frame: from the hugetlbfs pool if it has any left, otherwise by
+ * mapping 2 MB aligned memory and asking for transparent huge pages. The
+ * counters tell which buffers actually got them; the kernel may ignore the
+ * advice, e.g. with THP disabled or memory too fragmented. Finding out means
+ * reading /proc/self/smaps, so it is only done for the first buffer of every
+ * geometry, and the later ones are assumed to fare the same.
+ *
+ * Mapping, faulting in and unmapping every buffer for every frame costs far
+ * more than the frame's work on small frames, so drivers keep freed buffers
+ * in a small cache with scratch_cache_enable(): the next frame, or the next
+ * job, of the same geometry gets them back already mapped and faulted in.
+ * They are zeroed again on the way out, by the same row blocks of threads,
+ * so their pages stay where they were first touched.
+ */
+
+#define SCRATCH_PAGE 4096
+#define SCRATCH_HUGE_PAGE (2UL << 20)
+
+/* Room for the geometry in front of the buffer, keeping it 64-byte aligned. */
+#define SCRATCH_HEADER 64
+
+/* Enough for the 5 buffers of every strip of an 8-thread Pthreads frame. */
+#define SCRATCH_CACHE 48
+
+typedef struct {
+  size_t size;              // of the whole mapping
+  size_t rows;
+  size_t row_bytes;
+} scratch_header_t;
+
+typedef struct {
+  bool huge;                 // try huge pages for frame-sized buffers
+  unsigned long small;       // buffers on 4 KB pages, huge or not
+  unsigned long hugetlb;     // buffers from the hugetlbfs pool
+  unsigned long thp;         // buffers the kernel gave transparent huge pages
+  unsigned long thp_missed;  // buffers it did not, despite the advice
+} scratch_stats_t;
+
+static scratch_stats_t scratch_stats;
+
+static struct {
+  bool enabled;
+  int n;
+  uint8_t *buffers[SCRATCH_CACHE];    // oldest first
+  pthread_mutex_t lock;
+} scratch_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Geometries whose transparent huge pages were already looked up. */
+#define SCRATCH_THP_SAMPLES 16
+
+static struct {
+  int n;
+  struct {
+    size_t rows;
+    size_t row_bytes;
+    bool backed;
+  } samples[SCRATCH_THP_SAMPLES];
+  pthread_mutex_t lock;
+} scratch_thp = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define SCRATCH_COUNT(counter) __atomic_add_fetch(&scratch_stats.counter, 1, __ATOMIC_RELAXED)
+
+#ifdef _OPENMP
+#define SCRATCH_PARALLEL_FOR \
+  _Pragma("omp parallel for schedule(static) num_threads(nthreads)")
+#else
+#define SCRATCH_PARALLEL_FOR
+#endif
+
+/*
+ * Whether the mapping at p has transparent huge pages, as /proc/self/smaps
+ * reports it.
+ */
+static inline bool
+scratch_thp_backed(const void *p)
+{
+  const uintptr_t addr = (uintptr_t) p;
+  uintptr_t start, end;
+  unsigned long kb;
+  bool found = false, backed = false;
+  char line[256];
+
+  FILE *f = fopen("/proc/self/smaps", "r");
+  if (f == NULL)
+    return false;
+
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+      if (found)
+        break;
+      found = start <= addr && addr < end;
+    } else if (found && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+      backed = kb > 0;
+      break;
+    }
+  }
+
+  fclose(f);
+
+  return backed;
+}
+
+/*
+ * Whether the faulted in buffer at p got transparent huge pages, looked up
+ * for the first buffer of its geometry only.
+ */
+static inline bool
+scratch_thp_sample(const void *p, const size_t rows, const size_t row_bytes)
+{
+  bool backed;
+  int i;
+
+  pthread_mutex_lock(&scratch_thp.lock);
+
+  for (i = 0; i < scratch_thp.n; i++) {
+    if (scratch_thp.samples[i].rows == rows && scratch_thp.samples[i].row_bytes == row_bytes) {
+      backed = scratch_thp.samples[i].backed;
+      pthread_mutex_unlock(&scratch_thp.lock);
+      return backed;
+    }
+  }
+
+  backed = scratch_thp_backed(p);
+
+  /* Past the table, every buffer is looked up. */
+  if (scratch_thp.n < SCRATCH_THP_SAMPLES) {
+    scratch_thp.samples[scratch_thp.n].rows = rows;
+    scratch_thp.samples[scratch_thp.n].row_bytes = row_bytes;
+    scratch_thp.samples[scratch_thp.n].backed = backed;
+    scratch_thp.n++;
+  }
+
+  pthread_mutex_unlock(&scratch_thp.lock);
+
+  return backed;
+}
+
+/*
+ * Map size bytes on 2 MB pages if possible. Returns MAP_FAILED if not even
+ * 2 MB aligned memory could be mapped; *thp tells whether the pages still
+ * have to be faulted in to find out.
+ */
+static inline uint8_t *
+scratch_map_huge(const size_t size, bool *thp)
+{
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  uint8_t *p;
+
+  *thp = false;
+
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    SCRATCH_COUNT(hugetlb);
+    return p;
+  }
+
+  /* Over-map, then trim to a 2 MB boundary so that whole huge pages fit. */
+  uint8_t *raw = mmap(NULL, size + SCRATCH_HUGE_PAGE, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (raw == MAP_FAILED)
+    return raw;
+
+  p = (uint8_t *) (((uintptr_t) raw + SCRATCH_HUGE_PAGE - 1) & ~(SCRATCH_HUGE_PAGE - 1));
+  if (p > raw)
+    munmap(raw, p - raw);
+  munmap(p + size, raw + SCRATCH_HUGE_PAGE - p);
+
+  *thp = madvise(p, size, MADV_HUGEPAGE) == 0;
+  if (!*thp)
+    SCRATCH_COUNT(small);
+
+  return p;
+}
+
+static inline void
+scratch_cache_enable(void)
+{
+  scratch_cache.enabled = true;
+}
+
+/*
+ * A cached buffer of the same geometry, zeroed, or NULL if there is none.
+ */
+static inline uint8_t *
+scratch_reuse(const size_t rows, const size_t row_bytes, const int nthreads)
+{
+  uint8_t *p = NULL;
+  int i;
+
+  pthread_mutex_lock(&scratch_cache.lock);
+
+  for (i = scratch_cache.n - 1; i >= 0; i--) {
+    const scratch_header_t *h = (scratch_header_t *) (scratch_cache.buffers[i] - SCRATCH_HEADER);
+
+    if (h->rows == rows && h->row_bytes == row_bytes) {
+      p = scratch_cache.buffers[i];
+      memmove(scratch_cache.buffers + i, scratch_cache.buffers + i + 1,
+              (scratch_cache.n - i - 1) * sizeof(uint8_t *));
+      scratch_cache.n--;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&scratch_cache.lock);
+
+  if (p == NULL)
+    return NULL;
+
+  (void) nthreads;
+
+  SCRATCH_PARALLEL_FOR
+  for (size_t y = 0; y < rows; y++)
+    memset(p + y * row_bytes, 0, row_bytes);
+
+  return p;
+}
+
+static inline void *
+scratch_alloc(const size_t rows, const size_t row_bytes, const int nthreads)
+{
+  size_t size = SCRATCH_HEADER + rows * row_bytes;
+  uint8_t *p = MAP_FAILED;
+  bool thp = false;
+
+  if (scratch_cache.enabled) {
+    p = scratch_reuse(rows, row_bytes, nthreads);
+    if (p)
+      return p;
+    p = MAP_FAILED;
+  }
+
+  if (scratch_stats.huge && size >= SCRATCH_HUGE_PAGE) {
+    size = (size + SCRATCH_HUGE_PAGE - 1) & ~(SCRATCH_HUGE_PAGE - 1);
+    p = scratch_map_huge(size, &thp);
+  }
+
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    DIE(p == MAP_FAILED, "mmap");
+    SCRATCH_COUNT(small);
+  }
+
+  *(scratch_header_t *) p = (scratch_header_t) {size, rows, row_bytes};
+  p += SCRATCH_HEADER;
+
+  (void) nthreads;
+
+  /* One write per page is enough to fault it in. */
+  SCRATCH_PARALLEL_FOR
+  for (size_t y = 0; y < rows; y++) {
+    volatile uint8_t *row = p + y * row_bytes;
+
+    for (size_t x = 0; x < row_bytes; x += SCRATCH_PAGE)
+      row[x] = 0;
+  }
+
+  if (thp) {
+    if (scratch_thp_sample(p, rows, row_bytes))
+      SCRATCH_COUNT(thp);
+    else
+      SCRATCH_COUNT(thp_missed);
+  }
+
+  return p;
+}
+
+static inline void
+scratch_free(void *ptr)
+{
+  uint8_t *p = (uint8_t *) ptr - SCRATCH_HEADER;
+
+  if (ptr == NULL)
+    return;
+
+  if (scratch_cache.enabled) {
+    pthread_mutex_lock(&scratch_cache.lock);
+
+    /* Make room by unmapping the oldest buffer. */
+    if (scratch_cache.n == SCRATCH_CACHE) {
+      ptr = scratch_cache.buffers[0];
+      memmove(scratch_cache.buffers, scratch_cache.buffers + 1,
+              (SCRATCH_CACHE - 1) * sizeof(uint8_t *));
+      scratch_cache.n--;
+    } else {
+      ptr = NULL;
+    }
+
+    scratch_cache.buffers[scratch_cache.n++] = p + SCRATCH_HEADER;
+
+    pthread_mutex_unlock(&scratch_cache.lock);
+
+    if (ptr == NULL)
+      return;
+    p = (uint8_t *) ptr - SCRATCH_HEADER;
+  }
+
+  DIE(munmap(p, ((scratch_header_t *) p)->size) < 0, "munmap");
+}
+
+/*
+ * Print how the buffers were backed, if huge pages were asked for.
+ */
+static inline void
+scratch_report(FILE *f)
+{
+  if (!scratch_stats.huge)
+    return;
+
+  fprintf(f, "Huge pages: %lu hugetlb, %lu transparent, %lu advised but not backed, "
+             "%lu on small pages\n",
+          scratch_stats.hugetlb, scratch_stats.thp, scratch_stats.thp_missed,
+          scratch_stats.small);
+}
+
+#endif
@@ -0,0 +1,429 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hysteresis.h"
+#include "kernels.h"
+#include "utils.h"
+
+/*
+ * Row-streaming Canny edge detection.
+ *
+ * The frame is pushed one row at a time, e.g. as it is decoded, and every
+ * stage works on a ring of rows instead of a whole frame: kn luma rows for
+ * the kn x kn blur, 3 blurred rows for Sobel and 3 rows of gradient for
+ * non-maximum suppression, which classifies every pixel straight into the
+ * bit planes of hysteresis.h. So the pipeline holds O(width x kn) bytes and
+ * stays in cache, plus 2 bits per pixel for hysteresis.
+ *
+ * Hysteresis itself cannot work on a bounded window: an edge may wind back
+ * up to the first row, and a strong pixel on the last row can switch on
+ * weak pixels anywhere above. It runs on the whole bit planes once the last
+ * row is in.
+ *
+ * stream_frame() streams a whole frame on several threads, each through the
+ * rings of its own band of rows. A band also pushes the khalf + 2 rows above
+ * and below it that its first and last rows depend on, but only classifies
+ * its own rows, whose bit plane words no other band writes.
+ *
+ * The luma and blur rings hold every row twice, at slots k and k + n, so
+ * that the n rows under a kernel are always contiguous and the unrolled taps
+ * of kernels.h can read them with the frame width as stride. Every stage
+ * does the same arithmetic as canny_edge_detection() with the direct
+ * Gaussian (the recursive one needs whole columns), taking the pixels that
+ * the blur does not reach as 0, so the edges are the same.
+ */
+
+#define STREAM_MAX_BRIGHTNESS 255
+
+#ifdef _OPENMP
+#define STREAM_PARALLEL_FOR \
+  _Pragma("omp parallel for schedule(static, 1) num_threads(n)")
+#else
+#define STREAM_PARALLEL_FOR
+#endif
+
+typedef struct stream stream_t;
+
+struct stream {
+  int width;
+  int height;
+  int nthreads;
+  int t1, t2;
+
+  int kn;                   // Gaussian kernel size
+  float *kernel;
+  kernel_convolve_u8_t convolve;
+
+  uint8_t *luma;            // 2 * kn rows
+  int16_t *blur;            // 2 * 3 rows
+  int16_t *after_Gx;        // 3 rows
+  int16_t *after_Gy;        // 3 rows
+  int16_t *G;               // 3 rows
+  int16_t *zero;            // one row of zeros
+
+  int first;                // first row pushed
+  int rows;                 // luma rows pushed so far
+  int y0, y1;               // rows classified
+  hysteresis_t *hy;
+
+  stream_t **bands;         // of stream_frame(), the first one being this
+  int nbands;
+  bool band;                // kernel and hy belong to another stream
+};
+
+/*
+ * Allocate the rings.
+ */
+static inline void
+stream_rings(stream_t *s)
+{
+  const int width = s->width;
+
+  s->luma = calloc((size_t) 2 * s->kn * width, sizeof(uint8_t));
+  DIE(s->luma == NULL, "calloc");
+
+  s->blur = calloc((size_t) 2 * 3 * width, sizeof(int16_t));
+  DIE(s->blur == NULL, "calloc");
+
+  s->after_Gx = calloc((size_t) 3 * width, sizeof(int16_t));
+  DIE(s->after_Gx == NULL, "calloc");
+
+  s->after_Gy = calloc((size_t) 3 * width, sizeof(int16_t));
+  DIE(s->after_Gy == NULL, "calloc");
+
+  s->G = calloc((size_t) 3 * width, sizeof(int16_t));
+  DIE(s->G == NULL, "calloc");
+
+  s->zero = calloc(width, sizeof(int16_t));
+  DIE(s->zero == NULL, "calloc");
+}
+
+static inline stream_t *
+stream_create(const int   width,
+              const int   height,
+              const float sigma,
+              const int   t1,
+              const int   t2,
+              const int   nthreads)
+{
+  const int n = 2 * (int) (2 * sigma) + 3;
+  const float mean = (float) floor(n / 2.0);
+  size_t c = 0;
+  int i, j;
+
+  DIE(width <= n || height <= n, "frame smaller than the Gaussian kernel");
+
+  stream_t *s = calloc(1, sizeof(stream_t));
+  DIE(s == NULL, "calloc");
+
+  s->width = width;
+  s->height = height;
+  s->nthreads = nthreads;
+  s->t1 = t1;
+  s->t2 = t2;
+
+  /* Same kernel as gaussian_filter(). */
+  s->kn = n;
+  s->convolve = kernel_convolve_u8(n);
+  s->kernel = malloc(n * n * sizeof(float));
+  DIE(s->kernel == NULL, "malloc");
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++)
+      s->kernel[c++] = exp(-0.5 * (pow((i - mean) / sigma, 2.0) + pow((j - mean) / sigma, 2.0))) / (2 * M_PI * sigma * sigma);
+  }
+
+  stream_rings(s);
+  s->hy = hysteresis_create(width, height);
+
+  return s;
+}
+
+/*
+ * Another band of the frame of s, with rings of its own.
+ */
+static inline stream_t *
+stream_create_band(const stream_t *s)
+{
+  stream_t *band = malloc(sizeof(stream_t));
+  DIE(band == NULL, "malloc");
+
+  *band = *s;
+  band->bands = NULL;
+  band->nbands = 0;
+  band->band = true;
+  stream_rings(band);
+
+  return band;
+}
+
+static inline void
+stream_free(stream_t *s)
+{
+  int b;
+
+  for (b = 1; b < s->nbands; b++)
+    stream_free(s->bands[b]);
+  free(s->bands);
+
+  if (!s->band) {
+    free(s->kernel);
+    hysteresis_free(s->hy);
+  }
+
+  free(s->luma);
+  free(s->blur);
+  free(s->after_Gx);
+  free(s->after_Gy);
+  free(s->G);
+  free(s->zero);
+  free(s);
+}
+
+static inline int16_t *
+stream_row(int16_t *ring, const int y, const int n, const int width)
+{
+  return ring + (size_t) (y % n) * width;
+}
+
+/*
+ * Non-maximum suppression of row y, whose gradient and that of both its
+ * neighbours is in the ring, if it is one of the rows of s.
+ */
+static inline void
+stream_nms(stream_t *s, const int y)
+{
+  const int width = s->width;
+  const int16_t *up = y == 1 ? s->zero : stream_row(s->G, y - 1, 3, width);
+  const int16_t *mid = stream_row(s->G, y, 3, width);
+  const int16_t *down = y == s->height - 2 ? s->zero : stream_row(s->G, y + 1, 3, width);
+  const int16_t *gx = stream_row(s->after_Gx, y, 3, width);
+  const int16_t *gy = stream_row(s->after_Gy, y, 3, width);
+  const int t1 = s->t1;
+  const int t2 = s->t2;
+
+  if (y < s->y0 || y >= s->y1)
+    return;
+
+  for (int i = 1; i < width - 1; i++) {
+    int16_t nms = 0;
+
+    if (mid[i] >= t1) {
+      const float dir = (float) (fmod(atan2(gy[i], gx[i]) + M_PI, M_PI) / M_PI) * 8;
+
+      if (((dir <= 1 || dir > 7) && mid[i] > mid[i - 1] && mid[i] > mid[i + 1]) || // 0 deg
+          ((dir > 1 && dir <= 3) && mid[i] > up[i + 1] && mid[i] > down[i - 1]) ||  // 45 deg
+          ((dir > 3 && dir <= 5) && mid[i] > up[i] && mid[i] > down[i]) ||          // 90 deg
+          ((dir > 5 && dir <= 7) && mid[i] > up[i - 1] && mid[i] > down[i + 1]))    // 135 deg
+        nms = mid[i];
+    }
+
+    hysteresis_mark(s->hy, i, y, nms, t1, t2);
+  }
+}
+
+/*
+ * First row of the blur and first row thinned, once the rows above them are
+ * in the rings: the ones the blur does not reach are 0 from the top of the
+ * frame on, the others have to be computed first.
+ */
+static inline int
+stream_first_blurred(const stream_t *s)
+{
+  return s->first == 0 ? 0 : s->first + s->kn / 2;
+}
+
+static inline int
+stream_first_thinned(const stream_t *s)
+{
+  return s->first == 0 ? 1 : stream_first_blurred(s) + 2;
+}
+
+/*
+ * Sobel and gradient magnitude of row y, once the blurred rows y - 1 to
+ * y + 1 are in the ring. Row y - 1 then has all it needs to be thinned.
+ */
+static inline void
+stream_sobel(stream_t *s, const int y)
+{
+  static const float Gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+  static const float Gy[] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+  const int width = s->width;
+  const int16_t *window = s->blur + (size_t) ((y - 1) % 3) * width;
+  int16_t *gx = stream_row(s->after_Gx, y, 3, width);
+  int16_t *gy = stream_row(s->after_Gy, y, 3, width);
+  int16_t *G = stream_row(s->G, y, 3, width);
+
+  for (int m = 1; m < width - 1; m++) {
+    const int16_t *centre = window + width + m;
+
+    gx[m] = (int16_t) kernel_taps_3(centre, width, Gx);
+    gy[m] = (int16_t) kernel_taps_3(centre, width, Gy);
+    G[m] = (int16_t) hypot(gx[m], gy[m]);
+  }
+
+  if (y - 1 >= stream_first_thinned(s))
+    stream_nms(s, y - 1);
+  if (y == s->height - 2)
+    stream_nms(s, y);
+}
+
+/*
+ * Hand blurred row y, already in both of its ring slots, on to Sobel.
+ */
+static inline void
+stream_blurred(stream_t *s, const int y)
+{
+  if (y >= stream_first_blurred(s) + 2)
+    stream_sobel(s, y - 1);
+}
+
+/*
+ * Blur row y from the kn luma rows centred on it.
+ */
+static inline void
+stream_blur(stream_t *s, const int y)
+{
+  const int width = s->width;
+  const int khalf = s->kn / 2;
+  const uint8_t *window = s->luma + (size_t) ((y - khalf) % s->kn) * width;
+  int16_t *row = s->blur + (size_t) (y % 3) * width;
+
+  s->convolve(window + (size_t) khalf * width + khalf, width, row + khalf, width,
+              s->kernel, s->kn, width - 2 * khalf, 1, true);
+
+  memcpy(row + (size_t) 3 * width, row, width * sizeof(int16_t));
+  stream_blurred(s, y);
+}
+
+/*
+ * A row of zeros where the blur does not reach.
+ */
+static inline void
+stream_blur_zero(stream_t *s, const int y)
+{
+  int16_t *row = s->blur + (size_t) (y % 3) * s->width;
+
+  memset(row, 0, s->width * sizeof(int16_t));
+  memset(row + (size_t) 3 * s->width, 0, s->width * sizeof(int16_t));
+  stream_blurred(s, y);
+}
+
+/*
+ * Start streaming rows y0 to y1 of a frame, whose bit planes are already
+ * clear. The first row to push is then stream_band_first().
+ */
+static inline int
+stream_band_first(const stream_t *s, const int y0)
+{
+  return y0 - s->kn / 2 - 2 > 0 ? y0 - s->kn / 2 - 2 : 0;
+}
+
+static inline void
+stream_begin_band(stream_t *s, const int y0, const int y1)
+{
+  int y;
+
+  s->first = stream_band_first(s, y0);
+  s->rows = 0;
+  s->y0 = y0;
+  s->y1 = y1;
+
+  if (s->first == 0) {
+    for (y = 0; y < s->kn / 2; y++)
+      stream_blur_zero(s, y);
+  }
+}
+
+/*
+ * Start a new frame.
+ */
+static inline void
+stream_begin(stream_t *s)
+{
+  hysteresis_clear(s->hy);
+  stream_begin_band(s, 0, s->height);
+}
+
+/*
+ * Push the next luma row of the frame.
+ */
+static inline void
+stream_push_row(stream_t *s, const uint8_t *in)
+{
+  const int width = s->width;
+  const int khalf = s->kn / 2;
+  const int y = s->first + s->rows++;
+  uint8_t *slot = s->luma + (size_t) (y % s->kn) * width;
+  int b;
+
+  memcpy(slot, in, width);
+  memcpy(slot + (size_t) s->kn * width, in, width);
+
+  if (y >= s->first + s->kn - 1)
+    stream_blur(s, y - khalf);
+
+  if (y == s->height - 1) {
+    for (b = s->height - khalf; b < s->height; b++)
+      stream_blur_zero(s, b);
+  }
+}
+
+/*
+ * Once every row is in, trace the edges and write them to out, width *
+ * height bytes of 0 or STREAM_MAX_BRIGHTNESS.
+ */
+static inline void
+stream_end(stream_t *s, uint8_t *out)
+{
+  DIE(s->rows != s->height, "stream_end before the last row");
+
+  hysteresis_run(s->hy);
+  hysteresis_output(s->hy, out);
+}
+
+/*
+ * Stream the whole width * height frame in, in one band per thread, and
+ * write its edges to out as stream_end() does.
+ */
+static inline void
+stream_frame(stream_t *s, const uint8_t *in, uint8_t *out)
+{
+  const int n = s->nthreads < s->height ? s->nthreads : s->height;
+  int b;
+
+  if (s->nbands < n) {
+    s->bands = realloc(s->bands, n * sizeof(stream_t *));
+    DIE(s->bands == NULL, "realloc");
+
+    s->bands[0] = s;
+    for (b = s->nbands > 1 ? s->nbands : 1; b < n; b++)
+      s->bands[b] = stream_create_band(s);
+    s->nbands = n;
+  }
+
+  hysteresis_clear(s->hy);
+
+  STREAM_PARALLEL_FOR
+  for (b = 0; b < n; b++) {
+    stream_t *band = b == 0 ? s : s->bands[b];
+    const int y0 = (int) ((long) s->height * b / n);
+    const int y1 = (int) ((long) s->height * (b + 1) / n);
+    const int last = y1 + s->kn / 2 + 2 < s->height ? y1 + s->kn / 2 + 2 : s->height;
+
+    stream_begin_band(band, y0, y1);
+    for (int y = band->first; y < last; y++)
+      stream_push_row(band, in + (size_t) y * s->width);
+  }
+
+  hysteresis_run(s->hy);
+  hysteresis_output(s->hy, out);
+}
+
+#endif
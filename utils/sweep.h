@@ -0,0 +1,79 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "edgemap.h"
+#include "utils.h"
+
+/*
+ * Threshold sweep: every frame is blurred, differentiated and thinned once,
+ * then traced with hysteresis once per (lower, upper) threshold pair. The
+ * edges of every pair go to their own edge map file, named after the -e
+ * path followed by ".LOWER-UPPER".
+ */
+
+#define SWEEP_MAX 64
+
+typedef struct {
+  int n;
+  int lower[SWEEP_MAX];
+  int upper[SWEEP_MAX];
+  edgemap_t *maps[SWEEP_MAX];
+} sweep_t;
+
+/*
+ * Parse a comma-separated list of LOWER:UPPER pairs, e.g. "20:40,45:50".
+ * Returns 0 on success, -1 if list is malformed.
+ */
+static inline int
+sweep_parse(sweep_t *s, const char *list)
+{
+  const char *p = list;
+  int lower, upper, len;
+
+  s->n = 0;
+
+  while (*p) {
+    if (s->n == SWEEP_MAX || sscanf(p, "%d:%d%n", &lower, &upper, &len) != 2 ||
+        lower < 0 || upper < lower)
+      return -1;
+
+    s->lower[s->n] = lower;
+    s->upper[s->n] = upper;
+    s->n++;
+
+    p += len;
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+  }
+
+  return s->n > 0 ? 0 : -1;
+}
+
+static inline void
+sweep_create(sweep_t *s, const char *prefix, const int compression)
+{
+  char path[4096];
+  int i;
+
+  for (i = 0; i < s->n; i++) {
+    snprintf(path, sizeof(path), "%s.%d-%d", prefix, s->lower[i], s->upper[i]);
+    s->maps[i] = edgemap_create(path, compression);
+  }
+}
+
+static inline void
+sweep_close(sweep_t *s)
+{
+  int i;
+
+  for (i = 0; i < s->n; i++)
+    edgemap_close(s->maps[i]);
+}
+
+#endif